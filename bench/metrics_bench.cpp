@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "collector.hpp"
+#include "counter.hpp"
+#include "gauge.hpp"
+#include "histogram.hpp"
+#include "info.hpp"
+#include "meter.hpp"
+#include "native_histogram.hpp"
+#include "static_set.hpp"
+#include "summary.hpp"
+
+using namespace metrics;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    bool quick = false;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::filesystem::path directory = std::filesystem::temp_directory_path();
+};
+
+// One result line. Every sample is the mean cost of one batch of
+// operations, so the percentiles describe batch-to-batch variation.
+struct Result {
+    std::string name;
+    unsigned threads = 1;
+    uint64_t operations = 0;
+    std::vector<double> samples;
+    double bytes_per_second = 0.0;
+};
+
+double percentile(const std::vector<double> &sorted, double q) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const auto index = static_cast<std::size_t>(q * (sorted.size() - 1));
+    return sorted[index];
+}
+
+void print_json(const std::vector<Result> &results) {
+    std::printf("{\n  \"benchmarks\": [\n");
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const auto &r = results[i];
+        std::vector<double> sorted = r.samples;
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0.0;
+        for (double s : sorted) {
+            total += s;
+        }
+        const double mean = sorted.empty() ? 0.0 : total / sorted.size();
+        std::printf(
+            "    {\"name\": \"%s\", \"threads\": %u, \"operations\": %llu, "
+            "\"ns_per_op\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+            "\"p99\": %.3f, \"max\": %.3f",
+            r.name.c_str(), r.threads,
+            static_cast<unsigned long long>(r.operations), mean,
+            percentile(sorted, 0.5), percentile(sorted, 0.9),
+            percentile(sorted, 0.99), sorted.empty() ? 0.0 : sorted.back()
+        );
+        if (r.bytes_per_second > 0.0) {
+            std::printf(", \"bytes_per_second\": %.0f", r.bytes_per_second);
+        }
+        std::printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+}
+
+// Runs op(thread, i) batches * batch_size times on each of threads threads,
+// all starting together.
+Result run_threads(
+    std::string name,
+    unsigned threads,
+    std::size_t batches,
+    std::size_t batch_size,
+    const std::function<void(unsigned, std::size_t)> &op
+) {
+    Result result;
+    result.name = std::move(name);
+    result.threads = threads;
+    result.operations = uint64_t{threads} * batches * batch_size;
+
+    std::vector<std::vector<double>> samples(threads);
+    std::barrier start(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            auto &mine = samples[t];
+            mine.reserve(batches);
+            start.arrive_and_wait();
+            std::size_t i = 0;
+            for (std::size_t b = 0; b < batches; ++b) {
+                const auto begin = Clock::now();
+                for (std::size_t k = 0; k < batch_size; ++k) {
+                    op(t, i++);
+                }
+                const std::chrono::duration<double, std::nano> elapsed =
+                    Clock::now() - begin;
+                mine.push_back(elapsed.count() / batch_size);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (auto &mine : samples) {
+        result.samples.insert(result.samples.end(), mine.begin(), mine.end());
+    }
+    return result;
+}
+
+std::vector<unsigned> thread_counts(const Options &options) {
+    std::vector<unsigned> counts;
+    for (unsigned t = 1; t < options.max_threads; t *= 2) {
+        counts.push_back(t);
+    }
+    counts.push_back(options.max_threads);
+    return counts;
+}
+
+void bench_hot_paths(const Options &options, std::vector<Result> &results) {
+    const std::size_t batches = options.quick ? 100 : 1000;
+    const std::size_t batch_size = 1000;
+
+    for (unsigned threads : thread_counts(options)) {
+        Counter<> counter("counter");
+        results.push_back(run_threads(
+            "counter_inc", threads, batches, batch_size,
+            [&](unsigned, std::size_t) { counter.inc(); }
+        ));
+
+        ShardedCounter<> sharded("sharded_counter");
+        results.push_back(run_threads(
+            "sharded_counter_inc", threads, batches, batch_size,
+            [&](unsigned, std::size_t) { sharded.inc(); }
+        ));
+
+        Meter meter("meter");
+        results.push_back(run_threads(
+            "meter_mark", threads, batches, batch_size,
+            [&](unsigned, std::size_t) { meter.mark(); }
+        ));
+
+        Gauge<int64_t> gauge("gauge");
+        results.push_back(run_threads(
+            "gauge_inc", threads, batches, batch_size,
+            [&](unsigned, std::size_t) { gauge.inc(); }
+        ));
+        results.push_back(run_threads(
+            "gauge_set", threads, batches, batch_size,
+            [&](unsigned t, std::size_t i) {
+                gauge.set(static_cast<int64_t>(t * 1000 + (i & 1023)));
+            }
+        ));
+
+        Histogram linear("histogram_linear", linear_buckets(0, 10, 20));
+        results.push_back(run_threads(
+            "histogram_observe_linear", threads, batches, batch_size,
+            [&](unsigned, std::size_t i) {
+                linear.observe(static_cast<double>(i % 250));
+            }
+        ));
+
+        Histogram arbitrary(
+            "histogram_arbitrary",
+            std::vector<double>{0.5, 1, 2.5, 5, 10, 25, 50, 100, 250}
+        );
+        results.push_back(run_threads(
+            "histogram_observe_arbitrary", threads, batches, batch_size,
+            [&](unsigned, std::size_t i) {
+                arbitrary.observe(static_cast<double>(i % 300));
+            }
+        ));
+
+        NativeHistogram native("native_histogram");
+        results.push_back(run_threads(
+            "native_histogram_observe", threads, batches, batch_size,
+            [&](unsigned, std::size_t i) {
+                native.observe(static_cast<double>(i % 1000) + 0.5);
+            }
+        ));
+
+        Summary summary("summary");
+        results.push_back(run_threads(
+            "summary_observe", threads, batches, batch_size,
+            [&](unsigned, std::size_t i) {
+                summary.observe(static_cast<double>(i % 1000) + 0.5);
+            }
+        ));
+    }
+}
+
+void bench_serialization(const Options &options, std::vector<Result> &results) {
+    const std::size_t batches = options.quick ? 100 : 1000;
+    const std::size_t batch_size = 100;
+
+    Counter<> counter("counter");
+    counter.inc_by(123456789);
+    Gauge<double> gauge("gauge");
+    gauge.set(3.14159);
+    Histogram histogram("histogram", exponential_buckets(1, 2, 16));
+    NativeHistogram native("native_histogram");
+    Summary summary("summary");
+    for (int i = 0; i < 10000; ++i) {
+        histogram.observe(i);
+        native.observe(i);
+        summary.observe(i);
+    }
+    Info info("info", std::vector<std::pair<std::string, std::string>>{
+                          {"version", "1.2.3"}, {"commit", "abcdef"}});
+    StaticMetricSet<
+        "static_set", StaticCounter<"requests_total">,
+        StaticCounter<"errors_total">, StaticGauge<"connections">,
+        StaticGauge<"temperature", double>>
+        static_set;
+    static_set.inc_by<"requests_total">(123456789);
+    static_set.inc<"errors_total">();
+    static_set.set<"connections">(42);
+    static_set.set<"temperature">(3.14159);
+    Meter meter("meter");
+    meter.mark(123456789);
+
+    const std::pair<const char *, const Metric *> metrics[] = {
+        {"value_as_str_counter", &counter},
+        {"value_as_str_gauge", &gauge},
+        {"value_as_str_histogram", &histogram},
+        {"value_as_str_native_histogram", &native},
+        {"value_as_str_summary", &summary},
+        {"value_as_str_info", &info},
+        {"value_as_str_static_set", &static_set},
+        {"value_as_str_meter", &meter},
+    };
+    for (const auto &[name, metric] : metrics) {
+        results.push_back(run_threads(
+            name, 1, batches, batch_size,
+            [metric](unsigned, std::size_t) {
+                auto value = metric->value_as_str();
+                if (value.empty()) {
+                    std::abort();
+                }
+            }
+        ));
+    }
+}
+
+std::shared_ptr<MetricsCollector> make_collector(
+    std::size_t count,
+    std::vector<std::shared_ptr<Counter<>>> &all
+) {
+    auto collector = std::make_shared<MetricsCollector>();
+    all.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+        auto counter =
+            std::make_shared<Counter<>>("metric_" + std::to_string(i));
+        all.push_back(counter);
+        collector->register_metric(counter);
+    }
+    return collector;
+}
+
+// Cost of flush() itself: serialization and handing the line to the writer.
+void bench_flush(const Options &options, std::vector<Result> &results) {
+    const auto path = options.directory / "metrics_bench_flush.log";
+    for (std::size_t count : {std::size_t{10}, std::size_t{1000},
+                              std::size_t{100000}}) {
+        std::vector<std::shared_ptr<Counter<>>> all;
+        auto collector = make_collector(count, all);
+        const std::size_t flushes = std::max<std::size_t>(
+            options.quick ? 5 : 20, (options.quick ? 20000 : 200000) / count
+        );
+        results.push_back(run_threads(
+            "collector_flush_" + std::to_string(count) + "_metrics", 1,
+            flushes, 1,
+            [&](unsigned, std::size_t i) {
+                all[i % all.size()]->inc();
+                collector->flush(path.string());
+            }
+        ));
+        collector.reset();
+        std::filesystem::remove(path);
+    }
+}
+
+// Flushes a fixed number of lines and waits until the writer thread has
+// written all of them.
+void bench_end_to_end(const Options &options, std::vector<Result> &results) {
+    const auto path = options.directory / "metrics_bench_e2e.log";
+    std::filesystem::remove(path);
+    const std::size_t count = 1000;
+    const std::size_t flushes = options.quick ? 200 : 2000;
+
+    std::vector<std::shared_ptr<Counter<>>> all;
+    auto collector = make_collector(count, all);
+    const auto begin = Clock::now();
+    for (std::size_t i = 0; i < flushes; ++i) {
+        all[i % all.size()]->inc_by(i);
+        collector->flush(path.string());
+    }
+    // The destructor drains the writer queue.
+    collector.reset();
+    const std::chrono::duration<double> elapsed = Clock::now() - begin;
+
+    Result result;
+    result.name = "writer_end_to_end_1000_metrics";
+    result.operations = flushes;
+    result.samples.push_back(elapsed.count() * 1e9 / flushes);
+    result.bytes_per_second =
+        static_cast<double>(std::filesystem::file_size(path)) /
+        elapsed.count();
+    results.push_back(std::move(result));
+    std::filesystem::remove(path);
+}
+
+int usage(const char *program) {
+    std::fprintf(
+        stderr,
+        "usage: %s [--quick] [--threads N] [--dir DIR]\n"
+        "Benchmarks metric hot paths and collector flushes; prints JSON.\n",
+        program
+    );
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            options.quick = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.max_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            options.directory = argv[++i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    std::vector<Result> results;
+    bench_hot_paths(options, results);
+    bench_serialization(options, results);
+    bench_flush(options, results);
+    bench_end_to_end(options, results);
+    print_json(results);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#ifndef BINARY_FORMAT_HPP_
+#define BINARY_FORMAT_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "format.hpp"
+#include "timestamp.hpp"
+
+namespace metrics {
+
+// Compact encoding of the text lines written by MetricsCollector.
+//
+// A line body is split into a template (everything that is not a value:
+// metric names, bucket labels, separators) and the values themselves, as
+// located and typed by a ValueLayout recorded while the line was written.
+// The type of each slot is that of the metric's value, so a template does
+// not change with how a value happens to print. Templates are written once
+// per file as dictionary frames; each flush then stores only a template id,
+// a delta-of-delta timestamp and the values: integers as zigzag varint
+// deltas, floating-point values XOR-ed with the previous value of the same
+// slot (Gorilla). Decoding reproduces the original text exactly.
+//
+// Every frame is [type byte][varint payload length][payload]. A header
+// frame starts each file and resets the decoder, so files that were
+// appended to by several processes decode correctly.
+class BinaryEncoder {
+public:
+    BinaryEncoder();
+
+    // Appends the frames encoding one line to out. body is the line without
+    // the timestamp and without the trailing newline; values are its values
+    // as recorded by RecordValues, with offsets into body. Values of type
+    // NumberType::Other stay part of the template.
+    void encode(
+        std::string &out,
+        std::chrono::system_clock::time_point timestamp,
+        std::string_view body,
+        std::span<const ValueLayout::Value> values
+    );
+
+    // Forgets all state; the next encode() starts a new file header.
+    void reset() noexcept;
+
+private:
+    enum class Slot : uint8_t { Integer, Unsigned, Double, Float };
+
+    struct Template {
+        uint64_t id;
+        std::vector<uint64_t> values;
+        std::vector<uint8_t> leading;
+        std::vector<uint8_t> trailing;
+    };
+
+    static constexpr std::size_t max_templates = 4096;
+
+    bool header_written_;
+    int64_t previous_timestamp_;
+    int64_t previous_delta_;
+    std::unordered_map<std::string, Template> templates_;
+
+    std::string key_;
+    std::vector<std::string_view> segments_;
+    std::vector<Slot> slots_;
+    std::vector<uint64_t> values_;
+    std::string payload_;
+};
+
+class BinaryDecoder {
+public:
+    explicit BinaryDecoder(
+        TimestampFormat format = TimestampFormat::LocalTime
+    ) noexcept;
+
+    // Consumes a chunk of the binary stream and appends every complete line
+    // to out in the text format. Incomplete frames are kept until the next
+    // call. Returns false once the input is found to be malformed.
+    bool decode(std::string_view bytes, std::string &out);
+
+    // True when no partial frame is buffered.
+    bool idle() const noexcept;
+
+private:
+    struct Template {
+        std::vector<std::string> segments;
+        std::vector<uint8_t> slots;
+        std::vector<uint64_t> values;
+        std::vector<uint8_t> leading;
+        std::vector<uint8_t> trailing;
+    };
+
+    bool decode_frame(uint8_t type, std::string_view payload, std::string &out);
+    bool decode_template(std::string_view payload);
+    bool decode_record(std::string_view payload, std::string &out);
+
+    TimestampFormatter timestamp_;
+    std::string pending_;
+    bool failed_;
+    // Frames before the first header continue a stream that began in an
+    // earlier file, e.g. a segment started after a failed write, and are
+    // skipped.
+    bool started_;
+    int64_t previous_timestamp_;
+    int64_t previous_delta_;
+    std::unordered_map<uint64_t, Template> templates_;
+};
+
+}  // namespace metrics
+
+#endif
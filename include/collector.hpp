@@ -1,47 +1,412 @@
 #ifndef COLLECTOR_HPP_
 #define COLLECTOR_HPP_
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <ctime>
-#include <fstream>
-#include <iomanip>
+#include <cstdint>
 #include <memory>
 #include <mutex>
-#include <queue>
-#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include "binary_format.hpp"
+#include "compression.hpp"
+#include "counter.hpp"
+#include "family.hpp"
+#include "gauge.hpp"
+#include "histogram.hpp"
+#include "io_uring.hpp"
 #include "metric.hpp"
+#include "mpmc_queue.hpp"
+#include "registry.hpp"
+#include "ring_file.hpp"
+#include "timestamp.hpp"
 
 namespace metrics {
 
+enum class Encoding {
+    Text,
+    // See BinaryEncoder. Each binary sink must have a file of its own.
+    Binary,
+};
+
+// Rotation and compression of an output file, see
+// MetricsCollector::set_file_options.
+struct FileOptions {
+    // Start a new segment once the current one holds this many bytes on
+    // disk. Zero disables size rotation.
+    uint64_t max_size = 0;
+    // Start a new segment once the current one has been open this long.
+    // Zero disables time rotation.
+    std::chrono::seconds max_age{0};
+    // Finished segments to keep; older ones are deleted. Zero keeps all.
+    std::size_t max_segments = 0;
+    Compression compression = Compression::None;
+};
+
+struct SinkOptions {
+    // Flushes happen on multiples of the interval since the Unix epoch, so
+    // a one-second sink fires at every wall-clock second.
+    std::chrono::milliseconds interval{1000};
+    TimestampFormat timestamp = TimestampFormat::LocalTime;
+    Encoding encoding = Encoding::Text;
+    // Non-zero: filename is a RingFile with this many bytes of records.
+    // Lines are copied into the mapping by the scheduler thread instead of
+    // going through the writer queue, so they survive a crash right away.
+    // Only text lines are supported, as every record must stand alone.
+    std::size_t ring_size = 0;
+    // Applied with set_file_options unless left at the defaults. Binary
+    // sinks may be compressed but not rotated, as a segment could start
+    // without the dictionary.
+    FileOptions file;
+};
+
+// What a producer does when the writer queue is full.
+enum class QueuePolicy {
+    // Wait until the writer thread makes room. Nothing is lost.
+    Block,
+    // Discard the oldest queued line.
+    DropOldest,
+    // Discard the new line.
+    DropNewest,
+    // Append the line to an overflow task for the same file, written after
+    // the queue. The queue stays bounded, and the overflow holds at most one
+    // task per file and WriterOptions::max_overflow_bytes in all; lines
+    // beyond that are discarded and counted as dropped.
+    Merge,
+};
+
+enum class WriterBackend {
+    // io_uring when the kernel allows it, Sync otherwise.
+    Auto,
+    // One writev system call per file and batch.
+    Sync,
+    // The writes of a whole batch, to all files, in one io_uring
+    // submission; writes to the same file are linked so they stay in order.
+    // MetricsCollector throws std::system_error if io_uring is unavailable.
+    IoUring,
+};
+
+struct WriterOptions {
+    // Lines waiting for the writer thread, rounded up to a power of two.
+    std::size_t capacity = 1024;
+    // Binary sinks need every frame to decode, so only Block is safe for
+    // them, and Merge as long as the overflow stays under its limit.
+    QueuePolicy policy = QueuePolicy::Block;
+    // Merge only: bytes the overflow may hold while the writer is behind,
+    // for example on a stalled disk.
+    std::size_t max_overflow_bytes = std::size_t{64} << 20;
+    WriterBackend backend = WriterBackend::Auto;
+    // fdatasync every file after writing its share of a batch. With
+    // io_uring the sync is linked behind the writes.
+    bool sync_data = false;
+};
+
+struct WriterQueueStats {
+    std::size_t capacity;
+    std::size_t depth;
+    uint64_t dropped;
+    uint64_t merged;
+};
+
+struct SinkStats {
+    std::size_t id;
+    std::string filename;
+    std::chrono::milliseconds interval;
+    uint64_t flushes;
+    std::chrono::nanoseconds last_duration;
+    std::chrono::nanoseconds max_duration;
+};
+
+// The collector's own metrics, see MetricsCollector::register_self_metrics.
+// Durations are in seconds.
+struct CollectorMetrics {
+    // Lines waiting for the writer thread, sampled at serialization.
+    std::shared_ptr<Gauge<int64_t>> queue_depth;
+    // Time spent serializing the metrics under the collector lock.
+    std::shared_ptr<Histogram> flush_duration;
+    // Time to open and write one file's share of a writer batch.
+    std::shared_ptr<Histogram> write_duration;
+    // Failed opens and writes, and ring records that did not fit.
+    std::shared_ptr<Counter<>> write_errors;
+    // Lines discarded because the writer queue was full.
+    std::shared_ptr<Counter<>> dropped;
+    // Bytes written, labelled by file.
+    std::shared_ptr<Family<Counter<>>> bytes_written;
+};
+
 class MetricsCollector {
 public:
-    MetricsCollector();
+    explicit MetricsCollector(WriterOptions writer = {});
     ~MetricsCollector();
 
+    // Metrics are looked up by name, which must be unique among the live
+    // ones: registering another metric under a taken name throws
+    // std::invalid_argument, registering the same metric again does
+    // nothing.
     void register_metric(std::shared_ptr<Metric> metric);
+
+    // The collector does not keep the metric alive; it stops being written
+    // once its last owner releases it, and its entry is dropped by the next
+    // flush.
+    void register_weak_metric(const std::shared_ptr<Metric> &metric);
+
+    // Returns false if no live metric has the name.
+    bool unregister_metric(std::string_view name);
+
+    std::shared_ptr<Metric> find_metric(std::string_view name) const;
+
+    // The metric registered under name, or a new M(name, args...) that is
+    // registered and returned. Throws std::invalid_argument if the name
+    // belongs to a metric of another type.
+    template <typename M, typename... Args>
+    std::shared_ptr<M>
+    get_or_register(const std::string &name, Args &&...args) {
+        std::unique_lock lock(mutex_);
+        if (auto existing = metrics_.find(name)) {
+            if (auto typed = std::dynamic_pointer_cast<M>(existing)) {
+                return typed;
+            }
+            throw std::invalid_argument(
+                "metric registered with another type: " + name
+            );
+        }
+        auto metric = std::make_shared<M>(name, std::forward<Args>(args)...);
+        metrics_.add(metric);
+        return metric;
+    }
+
+    // Throws std::logic_error while an ExpositionServer is attached.
     void flush(std::string filename);
 
+    // Appends the OpenMetrics exposition of every registered metric,
+    // terminated by "# EOF". Unlike flush(), metrics are not reset. Counters
+    // are exposed as OpenMetrics counters, which must never go down, while
+    // every flush and sink resets them, and a scraper would read each reset
+    // as a restart. Expose and flush through separate collectors instead.
+    void render_openmetrics(std::string &out) const;
+
+    // Called by an ExpositionServer for the collector it serves. Throws
+    // std::logic_error if the collector has sinks; while any server is
+    // attached, flush() and add_sink() throw std::logic_error.
+    void attach_exposition();
+    void detach_exposition() noexcept;
+
+    // Output files stay open between flushes. After rotating a log file
+    // externally, call this so the writer reopens every file by name.
+    void reopen_files() noexcept;
+
+    void set_timestamp_format(TimestampFormat format);
+
+    // Rotation and compression for filename, whether written by flush() or
+    // a sink. Open files are finished and reopened with the new options.
+    // A compressed file is written as filename plus ".lz4" or ".gz", and
+    // finished segments are renamed to filename.YYYYMMDDTHHMMSS (UTC) plus
+    // that extension. The writer thread compresses batches and opens the new
+    // segment right away; a background thread ends the old segment's stream,
+    // closes it and deletes segments beyond max_segments. The first flush
+    // after a rotation is a delta keyframe. A compressed file that already
+    // holds data when it is opened, left by an earlier run or a failed
+    // write, is moved out as a segment first, so every stream starts in a
+    // file of its own. Throws std::invalid_argument for gzip when zlib was
+    // not found at build time, and for rotating a binary sink's file.
+    void set_file_options(const std::string &filename, FileOptions options);
+
+    // Creates the collector's own metrics, named prefix_queue_depth,
+    // prefix_flush_duration_seconds, prefix_write_duration_seconds,
+    // prefix_write_errors_total, prefix_dropped_total and
+    // prefix_bytes_written_total, and
+    // registers them here. Until then the collector only checks one pointer
+    // per flush and batch. Later calls return the existing metrics. Throws
+    // std::invalid_argument, registering none of them, if a name is taken.
+    const CollectorMetrics &
+    register_self_metrics(const std::string &prefix = "metrics_collector");
+
+    // Delta flushes write only the series that changed since the previous
+    // flush; a missing series keeps its last written value. Every
+    // keyframe_interval-th flush, and the first one after reopen_files(),
+    // writes all series so a reader can start from it. Zero, the default,
+    // writes every series on every flush. Change marks are shared by all
+    // flushes, so delta output is meant for a single stream of lines.
+    void set_delta_flush(std::size_t keyframe_interval);
+
+    // Periodic flushes driven by one scheduler thread owned by the collector.
+    // Sinks that are due on the same tick share one serialization of the
+    // metrics. The reported duration covers serialization and enqueueing.
+    // Throws std::invalid_argument for a binary ring sink, a rotated binary
+    // sink or a ring sink with file options, std::system_error if a ring
+    // file cannot be mapped, and std::logic_error while an ExpositionServer
+    // is attached.
+    std::size_t add_sink(std::string filename, SinkOptions options = {});
+    bool remove_sink(std::size_t id);
+    std::vector<SinkStats> sink_stats() const;
+
+    WriterQueueStats writer_queue_stats() const noexcept;
+
+    // Sync or IoUring, whichever the writer thread actually uses.
+    WriterBackend writer_backend() const noexcept;
+
 private:
 
-    std::string current_timestamp();
-    void write();
+    std::string take_buffer();
+    void append_metrics(std::string &buffer);
+    void enqueue(std::string filename, std::string buffer);
     void write_from_queue();
+    void observe_flush(std::chrono::steady_clock::time_point started);
+    void sample_queue_depth() const;
 
     mutable std::mutex mutex_;
-    std::vector<std::shared_ptr<Metric>> metrics_;
+    MetricRegistry metrics_;
+    TimestampFormatter timestamp_;
+    std::size_t keyframe_interval_;
+    std::size_t flushes_since_keyframe_;
+    uint64_t keyframe_generation_;
+    std::unique_ptr<CollectorMetrics> self_metrics_owner_;
+    std::atomic<CollectorMetrics *> self_metrics_;
 
     struct Task {
         std::string filename;
         std::string output;
     };
 
+    void wake_writer();
+    void push_blocking(Task &task);
+    void push_dropping_oldest(Task &task);
+    void push_or_merge(Task &task);
+    void count_dropped();
+    bool take_batch(std::vector<Task> &batch);
+
+    struct OpenFile {
+        int fd = -1;
+        // filename plus the compression extension.
+        std::string path;
+        FileOptions options;
+        uint64_t size = 0;
+        std::chrono::steady_clock::time_point opened;
+        std::unique_ptr<StreamCompressor> compressor;
+    };
+
+    // A rotated-out segment waiting for the finaliser thread.
+    struct FinishedSegment {
+        int fd;
+        std::string trailer;
+        std::string filename;
+        FileOptions options;
+    };
+
+    // One file's share of a writer batch.
+    struct FileWrite {
+        const std::string *filename = nullptr;
+        std::vector<iovec> iov;
+        OpenFile *open = nullptr;
+        std::string compressed;
+        uint64_t size = 0;
+        uint64_t written = 0;
+        int fd = -1;
+        int error = 0;
+        bool synced = false;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    void write_batch(std::vector<Task> &tasks);
+    void submit_writes(std::vector<FileWrite> &files);
+    void write_file(FileWrite &file);
+    void finish_write(FileWrite &file);
+    void prepare_write(FileWrite &file);
+    OpenFile *open_file(const std::string &filename);
+    void rotate_file(std::unordered_map<std::string, OpenFile>::iterator it);
+    void close_files() noexcept;
+    void finalise_segments();
+
+    static constexpr std::size_t max_spare_buffers = 8;
+    static constexpr unsigned uring_entries = 256;
+
     std::thread writer_;
-    std::queue<Task> writer_queue_;
-    mutable std::mutex file_mutex_;
-    std::condition_variable cv_;
-    bool stopped_;
+    // Both cleared for good if a submission fails.
+    std::unique_ptr<IoUring> uring_;
+    std::atomic<bool> use_uring_;
+    const bool sync_data_;
+    const QueuePolicy queue_policy_;
+    const std::size_t max_overflow_bytes_;
+    BoundedMpmcQueue<Task> writer_queue_;
+    std::atomic<bool> stopped_;
+    // Producers wake the writer only when it is about to sleep, at most
+    // once per sleep; it then drains everything that has accumulated.
+    std::atomic<bool> writer_sleeping_;
+    std::atomic<uint32_t> writer_wakeups_;
+    // Bumped after every batch taken off the queue; blocked producers wait
+    // on it.
+    std::atomic<uint32_t> writer_pops_;
+    std::atomic<uint32_t> blocked_producers_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> merged_;
+    // Merge policy only: tasks that did not fit, one per file, and their
+    // total size; both guarded by overflow_mutex_.
+    std::mutex overflow_mutex_;
+    std::vector<Task> overflow_;
+    std::size_t overflow_bytes_;
+    std::atomic<std::size_t> overflow_size_;
+
+    std::mutex spare_mutex_;
+    std::vector<std::string> spare_buffers_;
+
+    // Owned by the writer thread.
+    std::unordered_map<std::string, OpenFile> files_;
+    // Stamp and -N suffix of each file's latest segment. Suffixes only
+    // grow within a second, so pruned names are never reused.
+    std::unordered_map<std::string, std::pair<std::string, unsigned>>
+        last_segments_;
+    std::unordered_map<std::string, std::shared_ptr<Counter<>>> file_bytes_;
+    std::atomic<bool> reopen_requested_;
+    std::atomic<uint64_t> file_generation_;
+
+    std::mutex file_options_mutex_;
+    std::unordered_map<std::string, FileOptions> file_options_;
+
+    // Started on the first rotation.
+    std::thread finaliser_;
+    std::mutex finaliser_mutex_;
+    std::condition_variable finaliser_cv_;
+    std::vector<FinishedSegment> finished_segments_;
+    bool finaliser_stopped_;
+
+    struct Sink {
+        std::size_t id;
+        std::string filename;
+        SinkOptions options;
+        std::chrono::system_clock::time_point next_due;
+        std::shared_ptr<BinaryEncoder> encoder;
+        std::shared_ptr<RingFile> ring;
+        uint64_t generation = 0;
+        uint64_t flushes = 0;
+        std::chrono::nanoseconds last_duration{0};
+        std::chrono::nanoseconds max_duration{0};
+    };
+
+    void schedule();
+    bool writes_binary(const std::string &filename) const;
+    void run_due_sinks(std::chrono::system_clock::time_point now);
+    void append_to_ring(
+        const std::string &filename,
+        RingFile &ring,
+        const std::string &line
+    );
+
+    std::thread scheduler_;
+    TimestampFormatter scheduler_timestamp_;
+    ValueLayout scheduler_values_;
+    std::vector<Sink> sinks_;
+    std::size_t next_sink_id_;
+    mutable std::mutex scheduler_mutex_;
+    std::condition_variable scheduler_cv_;
+    bool scheduler_stopped_;
+    // Attached ExpositionServers; changed under scheduler_mutex_ so that it
+    // cannot race with add_sink(), read without it by flush().
+    std::atomic<std::size_t> expositions_;
 };
 
 }  // namespace metrics
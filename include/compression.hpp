@@ -0,0 +1,42 @@
+#ifndef COMPRESSION_HPP_
+#define COMPRESSION_HPP_
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace metrics {
+
+enum class Compression {
+    None,
+    // Built-in LZ4 frame encoder; the output reads with the lz4 tool.
+    Lz4,
+    // gzip through zlib, available when zlib was found at build time.
+    Gzip,
+};
+
+// Compresses a file as one stream that is flushed after every batch:
+// compress() feeds data and may hold some of it back, flush() makes the
+// output decode up to the end of the data seen so far, so a segment that
+// is still being written can be read. Matches reach back across flushes.
+// finish() flushes and ends the stream; a finished file may get another
+// stream appended, as both formats allow concatenation.
+class StreamCompressor {
+public:
+    virtual ~StreamCompressor() = default;
+
+    virtual void compress(std::string_view data, std::string &out) = 0;
+    virtual void flush(std::string &out) = 0;
+    virtual void finish(std::string &out) = 0;
+};
+
+// Returns nullptr for Compression::None. Throws std::invalid_argument for
+// Gzip when the library was built without zlib.
+std::unique_ptr<StreamCompressor> make_compressor(Compression compression);
+
+// File name extension of the format, e.g. ".gz"; empty for None.
+std::string_view compression_extension(Compression compression) noexcept;
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef EXPOSITION_SERVER_HPP_
+#define EXPOSITION_SERVER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "collector.hpp"
+
+namespace metrics {
+
+struct ExpositionOptions {
+    // TCP port on 127.0.0.1; zero picks a free one, see port().
+    uint16_t port = 9464;
+    // When set, listen on this Unix socket path instead of TCP.
+    std::string unix_socket;
+    // How often the snapshot is rendered from the collector.
+    std::chrono::milliseconds interval{1000};
+    std::size_t max_connections = 64;
+    std::chrono::milliseconds idle_timeout{30000};
+};
+
+// Minimal HTTP/1.1 server for the OpenMetrics text format on /metrics.
+//
+// A render thread asks the collector for the exposition every interval and
+// publishes it as an immutable snapshot; the previous snapshot's buffers
+// are reused once no response refers to them. The serving thread only
+// hands out the current snapshot, so a scrape never takes the collector
+// lock or touches a metric. Responses are gzip-compressed when the client
+// accepts it and zlib was found at build time; connections are kept alive.
+//
+// The collector must not be flushed or have sinks: flushes reset counters,
+// which scrapers would see going down, see render_openmetrics. The server
+// attaches to the collector, which then rejects flush() and add_sink()
+// until the server is destroyed.
+class ExpositionServer {
+public:
+    // Starts listening right away. Throws std::system_error if the socket
+    // cannot be bound, and std::logic_error if the collector has sinks.
+    explicit ExpositionServer(
+        MetricsCollector &collector,
+        ExpositionOptions options = {}
+    );
+    ~ExpositionServer();
+
+    ExpositionServer(const ExpositionServer &) = delete;
+    ExpositionServer &operator=(const ExpositionServer &) = delete;
+
+    // Bound TCP port, or zero for a Unix socket.
+    uint16_t port() const noexcept;
+
+private:
+    struct Snapshot {
+        std::string text;
+        std::string gzip;
+    };
+
+    struct Connection;
+
+    void render_loop();
+    void publish_snapshot(std::shared_ptr<Snapshot> &spare);
+    std::shared_ptr<const Snapshot> current_snapshot() const;
+    // Drops the response's reference, see publish_snapshot().
+    void release_snapshot(Connection &connection) const;
+
+    void serve_loop();
+    bool process(Connection &connection);
+    void respond(Connection &connection, std::string_view request);
+    bool send_pending(Connection &connection);
+
+    MetricsCollector &collector_;
+    const ExpositionOptions options_;
+    int listener_;
+    int wake_pipe_[2];
+    uint16_t port_;
+
+    mutable std::mutex snapshot_mutex_;
+    std::shared_ptr<Snapshot> snapshot_;
+    std::atomic<bool> gzip_requested_;
+
+    std::mutex render_mutex_;
+    std::condition_variable render_cv_;
+    bool stopped_;
+
+    std::thread render_thread_;
+    std::thread serve_thread_;
+};
+
+}  // namespace metrics
+
+#endif
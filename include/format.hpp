@@ -0,0 +1,106 @@
+#ifndef FORMAT_HPP_
+#define FORMAT_HPP_
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace metrics {
+
+// How a number written by append_number can be formatted back from its
+// 64-bit pattern: as int64_t, uint64_t, double or float. Other covers the
+// types written through operator<<.
+enum class NumberType : uint8_t { Signed, Unsigned, Double, Float, Other };
+
+template <typename N>
+constexpr NumberType number_type() noexcept {
+    if constexpr (std::is_same_v<N, bool> || !std::is_arithmetic_v<N>) {
+        return NumberType::Other;
+    } else if constexpr (std::is_integral_v<N> && sizeof(N) <= 8) {
+        return std::is_signed_v<N> ? NumberType::Signed : NumberType::Unsigned;
+    } else if constexpr (std::is_same_v<N, double>) {
+        return NumberType::Double;
+    } else if constexpr (std::is_same_v<N, float>) {
+        return NumberType::Float;
+    } else {
+        return NumberType::Other;
+    }
+}
+
+// The values written into one buffer, in order: where each one is and the
+// type it was written from. Filled while a RecordValues scope is active on
+// the thread, so the binary encoder learns the value types from the metrics
+// instead of from the text, where a double gauge may print as "13".
+struct ValueLayout {
+    struct Value {
+        std::size_t begin;
+        std::size_t end;
+        NumberType type;
+    };
+
+    const std::string *target = nullptr;
+    std::vector<Value> values;
+};
+
+inline constinit thread_local ValueLayout *recorded_values = nullptr;
+
+// Records into layout the values the thread appends to target, which
+// should be empty, until the scope ends.
+class RecordValues {
+public:
+    RecordValues(ValueLayout &layout, const std::string &target) noexcept
+        : previous_(recorded_values) {
+        layout.target = &target;
+        layout.values.clear();
+        recorded_values = &layout;
+    }
+
+    ~RecordValues() {
+        recorded_values = previous_;
+    }
+
+    RecordValues(const RecordValues &) = delete;
+    RecordValues &operator=(const RecordValues &) = delete;
+
+private:
+    ValueLayout *previous_;
+};
+
+// The layout recording values appended to out, if any.
+inline ValueLayout *value_layout_for(const std::string &out) noexcept {
+    ValueLayout *layout = recorded_values;
+    return layout != nullptr && layout->target == &out ? layout : nullptr;
+}
+
+// Appends the shortest round-trip representation of value to out without
+// allocating a temporary string. Non-arithmetic types go through
+// operator<<.
+template <typename N>
+void append_number(std::string &out, const N &value) {
+    if constexpr (std::is_arithmetic_v<N> && !std::is_same_v<N, bool>) {
+        char buffer[32];
+        auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        if constexpr (number_type<N>() != NumberType::Other) {
+            if (ValueLayout *layout = value_layout_for(out)) [[unlikely]] {
+                const std::size_t begin = out.size();
+                layout->values.push_back(
+                    {begin, begin + static_cast<std::size_t>(end - buffer),
+                     number_type<N>()}
+                );
+            }
+        }
+        out.append(buffer, end);
+    } else {
+        std::ostringstream oss;
+        oss << value;
+        out += std::move(oss).str();
+    }
+}
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef IO_URING_HPP_
+#define IO_URING_HPP_
+
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace metrics {
+
+struct IoCompletion {
+    uint64_t user_data;
+    // Bytes written, or a negative errno.
+    int result;
+};
+
+// Minimal io_uring submission and completion queue over the raw system
+// calls, for the collector's writer. Writes use the current file position,
+// so files opened with O_APPEND are appended to. Requests marked as linked
+// start only after the previous one has completed in full; a failed or
+// short request cancels the rest of its chain with -ECANCELED.
+class IoUring {
+public:
+    // Throws std::system_error when io_uring is unavailable: not built in,
+    // an old kernel, or blocked by a seccomp filter.
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // Submission entries that can still be prepared before submit().
+    unsigned free_entries() const noexcept;
+
+    // Both expect free_entries() > 0. iov must stay valid until submit()
+    // returns.
+    void writev(
+        int fd,
+        const iovec *iov,
+        unsigned count,
+        uint64_t user_data,
+        bool link
+    ) noexcept;
+    void fdatasync(int fd, uint64_t user_data, bool link) noexcept;
+
+    // Submits every prepared request with as few system calls as possible
+    // and waits until all of them have completed. Throws std::system_error
+    // if the kernel rejects the submission; requests it accepted before
+    // that may still be running, see abandon().
+    void submit(std::vector<IoCompletion> &completions);
+
+    // After submit() threw: waits for the requests the kernel had accepted
+    // and appends their completions; requests it never took are dropped.
+    // Their buffers may be released once this returns. The ring must not
+    // be used afterwards.
+    void abandon(std::vector<IoCompletion> &completions) noexcept;
+
+private:
+    struct Rings;
+
+    // Moves the available completions to completions and returns how many.
+    unsigned reap(std::vector<IoCompletion> &completions) noexcept;
+
+    std::unique_ptr<Rings> rings_;
+    unsigned prepared_;
+    // Accepted by the kernel and not reaped yet.
+    unsigned in_flight_;
+};
+
+}  // namespace metrics
+
+#endif
@@ -1,19 +1,128 @@
 #ifndef METRIC_HPP_
 #define METRIC_HPP_
 
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <string_view>
+#include <type_traits>
 
 namespace metrics {
 
+class ChangeFlag;
+
+enum class ScalarType : uint8_t { None, Unsigned, Signed, Double };
+
+// The single atomic number behind a plain Counter or Gauge. The collector
+// groups such metrics by type and flushes each group in one loop instead
+// of two virtual calls per metric. value points to a std::atomic of the
+// type; both pointers stay valid as long as the metric does.
+struct ScalarSlot {
+    ScalarType type = ScalarType::None;
+    void *value = nullptr;
+    ChangeFlag *changed = nullptr;
+};
+
 class Metric {
 public:
     virtual ~Metric() = default;
     virtual std::string_view name() const = 0;
-    virtual std::string value_as_str() const = 0;
+
+    // Appends the serialized value to out. The collector formats every
+    // metric straight into one buffer that is reused across flushes.
+    virtual void append_to(std::string &out) const = 0;
+
+    virtual std::string value_as_str() const {
+        std::string result;
+        append_to(result);
+        return result;
+    }
+
     virtual void reset() = 0;
+
+    // Appends the value like append_to and resets the metric in one step:
+    // an update racing with it is either in out or left for the next call,
+    // never dropped. The default suits metrics whose reset is a no-op.
+    virtual void collect_and_reset(std::string &out) {
+        append_to(out);
+        reset();
+    }
+
+    // Returns whether the value may have changed since the previous call and
+    // clears the mark. Delta flushes use it to skip idle series; metrics that
+    // do not track changes are always reported as changed. Not noexcept, as
+    // a family locks its children while it asks them.
+    virtual bool consume_changed() {
+        return true;
+    }
+
+    // OpenMetrics exposition, see openmetrics.hpp: the family type and the
+    // sample lines. By default the metric is untyped and its sample holds
+    // the append_to value. An empty type means the samples are whole
+    // families, TYPE lines included.
+    virtual std::string_view openmetrics_type() const noexcept {
+        return "unknown";
+    }
+
+    virtual void append_openmetrics_samples(std::string &out) const;
+
+    // Metrics whose value is one atomic number of a ScalarType may expose
+    // it. Their collect_and_reset must then be equivalent to exchanging
+    // the value with zero, marking the change flag if it was non-zero, and
+    // appending the old value.
+    virtual ScalarSlot scalar_slot() noexcept {
+        return {};
+    }
+};
+
+// Dirty mark for consume_changed(). Writers only store when the mark is
+// clear, so between flushes the hot path is a load of a shared cache line.
+// Starts set so that a new metric is written by the first flush.
+class ChangeFlag {
+public:
+    ChangeFlag() noexcept = default;
+
+    ChangeFlag(const ChangeFlag &other) noexcept
+        : changed_(other.changed_.load(std::memory_order_relaxed)) {
+    }
+
+    ChangeFlag &operator=(const ChangeFlag &other) noexcept {
+        changed_.store(
+            other.changed_.load(std::memory_order_relaxed),
+            std::memory_order_relaxed
+        );
+        return *this;
+    }
+
+    void mark() noexcept {
+        if (!changed_.load(std::memory_order_relaxed)) {
+            changed_.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // Only exchanges when the mark is set, so idle series cost a load.
+    bool consume() noexcept {
+        return changed_.load(std::memory_order_relaxed) &&
+               changed_.exchange(false, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> changed_{true};
 };
 
+template <typename A>
+ScalarSlot make_scalar_slot(A &value, ChangeFlag &changed) noexcept {
+    if constexpr (std::is_same_v<A, std::atomic<uint64_t>>) {
+        return {ScalarType::Unsigned, &value, &changed};
+    } else if constexpr (std::is_same_v<A, std::atomic<int64_t>>) {
+        return {ScalarType::Signed, &value, &changed};
+    } else if constexpr (std::is_same_v<A, std::atomic<double>>) {
+        return {ScalarType::Double, &value, &changed};
+    } else {
+        return {};
+    }
+}
+
 }  // namespace metrics
 
-#endif
\ No newline at end of file
+#endif
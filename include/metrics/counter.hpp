@@ -1,10 +1,15 @@
 #ifndef COUNTER_HPP
 #define COUNTER_HPP
 
+#include <atomic>
 #include <memory>
+#include <string>
 #include <string_view>
 #include <type_traits>
+#include "format.hpp"
 #include "metric.hpp"
+#include "openmetrics.hpp"
+#include "sharded.hpp"
 
 namespace metrics {
 
@@ -12,14 +17,24 @@ template <typename N = uint64_t, typename A = std::atomic<N>>
 class Counter : public Metric {
 public:
     Counter(const char *name) noexcept
-        : name_(name), inner_(std::make_shared<A>()) {
+        : name_(name), state_(std::make_shared<State>()) {
     }
 
     template <
         typename S,
         typename = std::enable_if_t<std::is_convertible_v<S, std::string>>>
     Counter(S &&name)
-        : name_(std::forward<S>(name)), inner_(std::make_shared<A>()) {
+        : name_(std::forward<S>(name)), state_(std::make_shared<State>()) {
+    }
+
+    // Keeps the value in the given storage instead of a private atomic,
+    // e.g. a SharedAtomic slot of a shared memory segment.
+    template <
+        typename S,
+        typename = std::enable_if_t<std::is_convertible_v<S, std::string>>>
+    Counter(S &&name, A storage)
+        : name_(std::forward<S>(name)),
+          state_(std::make_shared<State>(std::move(storage))) {
     }
 
     Counter(const Counter &) = default;
@@ -32,40 +47,78 @@ public:
     }
 
     N inc_by(N v) {
-        return inner_->fetch_add(v, std::memory_order_relaxed);
+        N previous = state_->value.fetch_add(v, std::memory_order_relaxed);
+        state_->changed.mark();
+        return previous;
     }
 
     N get() const noexcept {
-        return inner_->load(std::memory_order_relaxed);
+        return state_->value.load(std::memory_order_relaxed);
     }
 
     std::shared_ptr<A> inner() const noexcept {
-        return inner_;
+        return std::shared_ptr<A>(state_, &state_->value);
     }
 
     std::string_view name() const noexcept override {
         return name_;
     }
 
-    std::string value_as_str() const override {
-        if constexpr (std::is_arithmetic_v<N>) {
-            return std::to_string(get());
-        } else {
-            std::ostringstream oss;
-            oss << get();
-            return std::move(oss).str();
-        }
+    void append_to(std::string &out) const override {
+        append_number(out, get());
+    }
+
+    std::string_view openmetrics_type() const noexcept override {
+        return "counter";
+    }
+
+    void append_openmetrics_samples(std::string &out) const override {
+        auto name = split_metric_name(name_);
+        name.family = strip_suffix(name.family, "_total");
+        append_value_sample(out, name, "_total", get());
     }
 
     void reset() noexcept override {
-        inner_->store(N{}, std::memory_order_relaxed);
+        if (state_->value.exchange(N{}, std::memory_order_relaxed) != N{}) {
+            state_->changed.mark();
+        }
+    }
+
+    void collect_and_reset(std::string &out) override {
+        const N value = state_->value.exchange(N{}, std::memory_order_relaxed);
+        if (value != N{}) {
+            state_->changed.mark();
+        }
+        append_number(out, value);
+    }
+
+    ScalarSlot scalar_slot() noexcept override {
+        return make_scalar_slot(state_->value, state_->changed);
+    }
+
+    bool consume_changed() noexcept override {
+        return state_->changed.consume();
     }
 
 private:
+    // Copies share the value and its change mark.
+    struct State {
+        State() = default;
+
+        explicit State(A storage) : value(std::move(storage)) {
+        }
+
+        A value{};
+        ChangeFlag changed;
+    };
+
     const std::string name_;
-    std::shared_ptr<A> inner_;
+    std::shared_ptr<State> state_;
 };
 
+template <typename N = uint64_t, std::size_t Shards = 32>
+using ShardedCounter = Counter<N, ShardedAtomic<N, Shards>>;
+
 template <typename N = uint64_t>
 class ConstCounter : public Metric {
 public:
@@ -91,23 +144,32 @@ public:
         return name_;
     }
 
-    std::string value_as_str() const override {
-        if constexpr (std::is_arithmetic_v<N>) {
-            return std::to_string(get());
-        } else {
-            std::ostringstream oss;
-            oss << get();
-            return std::move(oss).str();
-        }
+    void append_to(std::string &out) const override {
+        append_number(out, get());
+    }
+
+    std::string_view openmetrics_type() const noexcept override {
+        return "counter";
+    }
+
+    void append_openmetrics_samples(std::string &out) const override {
+        auto name = split_metric_name(name_);
+        name.family = strip_suffix(name.family, "_total");
+        append_value_sample(out, name, "_total", get());
     }
 
     void reset() noexcept override {
         return;
     }
 
+    bool consume_changed() noexcept override {
+        return written_.consume();
+    }
+
 private:
     const std::string name_;
     const N value_;
+    ChangeFlag written_;
 };
 
 }  // namespace metrics
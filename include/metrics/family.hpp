@@ -0,0 +1,247 @@
+#ifndef FAMILY_HPP_
+#define FAMILY_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "metric.hpp"
+
+namespace metrics {
+
+// A set of metrics of one type that share a name and differ by label values,
+// e.g. http_requests{route="/",status="200"}. Children are created on first
+// access and never removed, so the returned handles stay valid and can be
+// cached by callers to skip the lookup entirely.
+template <typename T>
+class Family : public Metric {
+public:
+    using Factory = std::function<std::shared_ptr<T>(std::string)>;
+
+    template <typename S>
+        requires std::is_convertible_v<S, std::string>
+    Family(
+        S &&name,
+        std::vector<std::string> label_names,
+        Factory factory = [](std::string name) {
+            return std::make_shared<T>(std::move(name));
+        }
+    )
+        : name_(std::forward<S>(name)),
+          label_names_(std::move(label_names)),
+          factory_(std::move(factory)) {
+    }
+
+    Family(const Family &) = delete;
+    Family(Family &&) = delete;
+    Family &operator=(const Family &) = delete;
+    Family &operator=(Family &&) = delete;
+
+    std::shared_ptr<T> with_labels(std::span<const std::string_view> values) {
+        if (values.size() != label_names_.size()) {
+            throw std::invalid_argument(
+                "label value count does not match label names of " + name_
+            );
+        }
+        {
+            std::shared_lock lock(mutex_);
+            auto it = children_.find(values);
+            if (it != children_.end()) {
+                return it->second;
+            }
+        }
+
+        std::unique_lock lock(mutex_);
+        auto it = children_.find(values);
+        if (it != children_.end()) {
+            return it->second;
+        }
+        auto child = factory_(child_name(values));
+        children_.emplace(
+            std::vector<std::string>(values.begin(), values.end()), child
+        );
+        order_.push_back(child);
+        if (!typed_.load(std::memory_order_relaxed)) {
+            type_ = child->openmetrics_type();
+            typed_.store(true, std::memory_order_release);
+        }
+        added_.mark();
+        return child;
+    }
+
+    std::shared_ptr<T>
+    with_labels(std::initializer_list<std::string_view> values) {
+        return with_labels(std::span(values.begin(), values.size()));
+    }
+
+    const std::vector<std::string> &label_names() const noexcept {
+        return label_names_;
+    }
+
+    std::size_t size() const {
+        std::shared_lock lock(mutex_);
+        return order_.size();
+    }
+
+    std::string_view name() const noexcept override {
+        return name_;
+    }
+
+    void append_to(std::string &out) const override {
+        std::shared_lock lock(mutex_);
+        out += '{';
+        for (std::size_t i = 0; i < order_.size(); ++i) {
+            if (i > 0) {
+                out += ' ';
+            }
+            out += '"';
+            out += order_[i]->name();
+            out += "\" ";
+            order_[i]->append_to(out);
+        }
+        out += '}';
+    }
+
+    // Children share the family's TYPE line, so only their samples are
+    // written. The type is taken from the first child and never changes,
+    // so it is read without the lock.
+    std::string_view openmetrics_type() const noexcept override {
+        if (!typed_.load(std::memory_order_acquire)) {
+            return Metric::openmetrics_type();
+        }
+        return type_;
+    }
+
+    void append_openmetrics_samples(std::string &out) const override {
+        std::shared_lock lock(mutex_);
+        for (const auto &child : order_) {
+            child->append_openmetrics_samples(out);
+        }
+    }
+
+    void reset() override {
+        std::shared_lock lock(mutex_);
+        for (auto &child : order_) {
+            child->reset();
+        }
+    }
+
+    void collect_and_reset(std::string &out) override {
+        std::shared_lock lock(mutex_);
+        out += '{';
+        for (std::size_t i = 0; i < order_.size(); ++i) {
+            if (i > 0) {
+                out += ' ';
+            }
+            out += '"';
+            out += order_[i]->name();
+            out += "\" ";
+            order_[i]->collect_and_reset(out);
+        }
+        out += '}';
+    }
+
+    // The family is written as one block, so it has changed when any child
+    // has. Every child is asked so that all their marks are cleared.
+    bool consume_changed() override {
+        std::shared_lock lock(mutex_);
+        bool changed = added_.consume();
+        for (auto &child : order_) {
+            changed |= child->consume_changed();
+        }
+        return changed;
+    }
+
+private:
+    struct LabelsHash {
+        using is_transparent = void;
+
+        template <typename Values>
+        std::size_t operator()(const Values &values) const noexcept {
+            std::size_t seed = values.size();
+            for (std::string_view value : values) {
+                seed ^= std::hash<std::string_view>{}(value) + 0x9e3779b9 +
+                        (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+
+    struct LabelsEqual {
+        using is_transparent = void;
+
+        template <typename L, typename R>
+        bool operator()(const L &lhs, const R &rhs) const noexcept {
+            if (lhs.size() != rhs.size()) {
+                return false;
+            }
+            for (std::size_t i = 0; i < lhs.size(); ++i) {
+                if (std::string_view(lhs[i]) != std::string_view(rhs[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    std::string child_name(std::span<const std::string_view> values) const {
+        std::string result = name_;
+        result += '{';
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            if (i > 0) {
+                result += ',';
+            }
+            result += label_names_[i];
+            result += "=\"";
+            for (char c : values[i]) {
+                switch (c) {
+                    case '\\':
+                        result += "\\\\";
+                        break;
+                    case '"':
+                        result += "\\\"";
+                        break;
+                    case '\n':
+                        result += "\\n";
+                        break;
+                    default:
+                        result += c;
+                }
+            }
+            result += '"';
+        }
+        result += '}';
+        return result;
+    }
+
+    const std::string name_;
+    const std::vector<std::string> label_names_;
+    const Factory factory_;
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<
+        std::vector<std::string>,
+        std::shared_ptr<T>,
+        LabelsHash,
+        LabelsEqual>
+        children_;
+    std::vector<std::shared_ptr<T>> order_;
+    // Set once, by the first with_labels() that adds a child; type_ is
+    // written before typed_ is published.
+    std::string_view type_;
+    std::atomic<bool> typed_{false};
+    ChangeFlag added_;
+};
+
+}  // namespace metrics
+
+#endif
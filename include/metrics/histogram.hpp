@@ -4,21 +4,23 @@
 #include <algorithm>
 #include <atomic>
 #include <cmath>
-#include <iomanip>
+#include <functional>
 #include <limits>
 #include <memory>
 #include <mutex>
-#include <shared_mutex>
-#include <sstream>
 #include <string>
 #include <string_view>
 #include <vector>
+#include "format.hpp"
 #include "metric.hpp"
+#include "sharded.hpp"
 
 namespace metrics {
 
 class Histogram : public Metric {
 public:
+    enum class Layout { Arbitrary, Linear, Exponential };
+
     struct Snapshot {
         double sum;
         uint64_t count;
@@ -26,20 +28,46 @@ public:
         std::vector<uint64_t> counters;
     };
 
+    // Counters and sum kept in memory owned by someone else, e.g. a shared
+    // memory segment; owner keeps that memory alive.
+    struct Storage {
+        std::atomic<uint64_t> *counters;
+        std::atomic<double> *sum;
+        std::shared_ptr<void> owner;
+    };
+
+    // Called with the final bounds, +Inf included; must return one counter
+    // per bound.
+    using StorageFactory =
+        std::function<Storage(const std::vector<double> &bounds)>;
+
     template <
         typename S,
         typename B,
         typename = std::enable_if<std::is_convertible_v<S, std::string>>,
         typename =
             std::enable_if<std::is_convertible_v<B, std::vector<double>>>>
-    Histogram(S &&name, B &&buckets)
-        : name_(std::forward<S>(name)),
-          inner_(std::make_unique<Inner>()),
-          is_cached(false) {
+    Histogram(S &&name, B &&buckets, const StorageFactory &storage = {})
+        : name_(std::forward<S>(name)), inner_(std::make_unique<Inner>()) {
         inner_->buckets = std::forward<B>(buckets);
         std::sort(inner_->buckets.begin(), inner_->buckets.end());
         inner_->buckets.push_back(std::numeric_limits<double>::infinity());
-        inner_->counters.resize(inner_->buckets.size(), 0);
+        const std::size_t size = inner_->buckets.size();
+        if (storage) {
+            Storage external = storage(inner_->buckets);
+            inner_->counters[0] = inner_->counters[1] = external.counters;
+            inner_->sum[0] = inner_->sum[1] = external.sum;
+            inner_->owner = std::move(external.owner);
+        } else {
+            inner_->own_counters =
+                std::make_unique<std::atomic<uint64_t>[]>(2 * size);
+            inner_->counters[0] = inner_->own_counters.get();
+            inner_->counters[1] = inner_->own_counters.get() + size;
+            inner_->sum[0] = &inner_->own_sum[0];
+            inner_->sum[1] = &inner_->own_sum[1];
+        }
+        detect_layout();
+        format_labels();
     }
 
     Histogram() = delete;
@@ -49,25 +77,81 @@ public:
     Histogram &operator=(Histogram &&) = delete;
 
     void observe(double value) noexcept;
-    Snapshot get() const noexcept;
+    // Takes the collection lock and copies the buckets, so it may throw.
+    Snapshot get() const;
+    Layout layout() const noexcept;
 
     std::string_view name() const noexcept override;
-    std::string value_as_str() const override;
+    void append_to(std::string &out) const override;
+    std::string_view openmetrics_type() const noexcept override;
+    void append_openmetrics_samples(std::string &out) const override;
     void reset() noexcept override;
+    void collect_and_reset(std::string &out) override;
+    bool consume_changed() noexcept override;
 
 private:
+    struct alignas(cache_line_size) PaddedCount {
+        std::atomic<uint64_t> value{0};
+    };
+
+    // Bucket bounds are immutable after construction, so observe() only
+    // touches atomics. The total count is not stored separately: snapshots
+    // derive it from the bucket counters, which keeps _count equal to the
+    // +Inf bucket.
+    //
+    // Counters and sum are kept twice. observe() writes to the half named
+    // by the top bit of started; a collection flips that bit, waits until
+    // every observation counted in started has finished, and then reads
+    // and clears the old half while no one writes to it. Readers and
+    // collectors take collect_mutex, which observe() never touches.
+    // External storage has a single half that both entries point to; it is
+    // cleared counter by counter with exchange, which loses nothing but
+    // may split one observation across two collections.
+    //
+    // started, finished[0] and finished[1] are written by every observe()
+    // and sit on their own cache lines, so that observers in different
+    // halves and the spinning collector do not invalidate each other or
+    // the read-mostly fields that follow.
     struct Inner {
-        double sum = 0.0;
-        uint64_t count = 0;
+        alignas(cache_line_size) std::atomic<uint64_t> started{0};
+        PaddedCount finished[2];
+        alignas(cache_line_size) std::atomic<double> *sum[2] = {};
+        std::atomic<uint64_t> *counters[2] = {};
+        std::mutex collect_mutex;
+        ChangeFlag changed;
         std::vector<double> buckets;
-        std::vector<uint64_t> counters;
+        std::atomic<double> own_sum[2] = {};
+        std::unique_ptr<std::atomic<uint64_t>[]> own_counters;
+        std::shared_ptr<void> owner;
+        Layout layout = Layout::Arbitrary;
+        double origin = 0.0;
+        double scale = 0.0;
+        std::vector<std::string> labels;
     };
 
+    // Recognises bounds produced by linear_buckets/exponential_buckets so
+    // that observe() can compute the bucket index arithmetically instead of
+    // searching. Any other layout falls back to a branchless binary search.
+    void detect_layout() noexcept;
+    std::size_t bucket_index(double value) const noexcept;
+
+    // The half observe() currently writes to; stable under collect_mutex.
+    std::size_t hot_half() const noexcept;
+
+    // Makes the other half hot and returns the old one once it is quiet.
+    // Expects collect_mutex to be held.
+    std::size_t swap_halves() noexcept;
+
+    // Writes the append_to form of one half, optionally clearing it, and
+    // returns its observation count.
+    uint64_t append_half(std::string &out, std::size_t half, bool clear) const;
+
+    // Series names and bounds are fixed, so every "name_bucket{le=...}"
+    // prefix is rendered once at construction.
+    void format_labels();
+
     const std::string name_;
     std::unique_ptr<Inner> inner_;
-    mutable bool is_cached;
-    mutable std::string cached_value;
-    mutable std::shared_mutex mutex_;
 };
 
 std::vector<double>
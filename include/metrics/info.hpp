@@ -5,6 +5,7 @@
 #include <string_view>
 #include <vector>
 #include "metric.hpp"
+#include "openmetrics.hpp"
 
 namespace metrics {
 
@@ -18,9 +19,9 @@ public:
             L,
             std::vector<std::pair<std::string, std::string>>>>>
     explicit Info(S &&name, L &&labels)
-        : name_(std::forward<S>(name)),
-          labels_(std::forward<L>(labels)),
-          is_cached_{false} {
+        : labels_(std::forward<L>(labels)),
+          name_(std::forward<S>(name)),
+          value_(format_labels(labels_)) {
     }
 
     Info(const Info &) = default;
@@ -37,13 +38,37 @@ public:
         return name_;
     }
 
-    std::string value_as_str() const override {
-        if (is_cached_) {
-            return cached_value_;
-        }
+    void append_to(std::string &out) const override {
+        out += value_;
+    }
+
+    std::string_view openmetrics_type() const noexcept override {
+        return "info";
+    }
+
+    void append_openmetrics_samples(std::string &out) const override {
+        auto name = split_metric_name(name_);
+        name.family = strip_suffix(name.family, "_info");
+        // value_ is the label set in braces.
+        name.labels = std::string_view(value_).substr(1, value_.size() - 2);
+        append_value_sample(out, name, "_info", 1);
+    }
+
+    void reset() noexcept override {
+        return;
+    }
 
+    bool consume_changed() noexcept override {
+        return written_.consume();
+    }
+
+private:
+    // Labels never change, so the serialized form is built once.
+    static std::string format_labels(
+        const std::vector<std::pair<std::string, std::string>> &labels
+    ) {
         std::size_t length = 2;
-        for (const auto &[label, value] : labels_) {
+        for (const auto &[label, value] : labels) {
             length += label.size() + value.size() + 5;
         }
         length -= 1;
@@ -52,8 +77,8 @@ public:
         result.reserve(length);
 
         result += '{';
-        for (std::size_t i = 0; i < labels_.size(); ++i) {
-            const auto &[label, value] = labels_[i];
+        for (std::size_t i = 0; i < labels.size(); ++i) {
+            const auto &[label, value] = labels[i];
             if (i > 0) {
                 result += ",";
             }
@@ -63,22 +88,13 @@ public:
             result += '"';
         }
         result += '}';
-
-        cached_value_ = result;
-        is_cached_ = true;
-
         return result;
     }
 
-    void reset() noexcept override {
-        return;
-    }
-
-private:
     const std::vector<std::pair<std::string, std::string>> labels_;
     std::string name_;
-    mutable bool is_cached_;
-    mutable std::string cached_value_;
+    std::string value_;
+    ChangeFlag written_;
 };
 
 }  // namespace metrics
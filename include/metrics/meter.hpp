@@ -0,0 +1,94 @@
+#ifndef METER_HPP_
+#define METER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "format.hpp"
+#include "metric.hpp"
+#include "sharded.hpp"
+
+namespace metrics {
+
+// Rate of events: exponentially weighted moving averages over 1, 5 and 15
+// minutes, as the Unix load average computes them, plus the mean rate
+// since creation, all per second.
+//
+// mark() is a single relaxed fetch_add. There is no timer: the averages
+// advance in tick_interval steps when the meter is read, or on tick(). A
+// read that finds several intervals elapsed applies them at once, treating
+// the events since the last tick as spread evenly across those intervals.
+// One reader at a time advances the averages; concurrent readers do not
+// wait and see the previous values.
+//
+// Flushes do not reset a meter, so its averages span flushes; reset()
+// starts it over.
+class Meter : public Metric {
+public:
+    static constexpr std::chrono::seconds tick_interval{5};
+
+    struct Rates {
+        uint64_t count;
+        double m1;
+        double m5;
+        double m15;
+        double mean;
+    };
+
+    template <
+        typename S,
+        typename = std::enable_if_t<std::is_convertible_v<S, std::string>>>
+    explicit Meter(S &&name) : name_(std::forward<S>(name)) {
+        start();
+    }
+
+    Meter() = delete;
+    Meter(const Meter &) = delete;
+    Meter(Meter &&) = delete;
+    Meter &operator=(const Meter &) = delete;
+    Meter &operator=(Meter &&) = delete;
+
+    void mark(uint64_t n = 1) noexcept {
+        count_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const noexcept;
+
+    // Advances the averages to the current time first.
+    Rates rates() const noexcept;
+
+    // Advances the averages if a tick interval has passed.
+    void tick() const noexcept;
+
+    std::string_view name() const noexcept override;
+    void append_to(std::string &out) const override;
+    // The count is a counter and every rate a gauge family of its own.
+    std::string_view openmetrics_type() const noexcept override;
+    void append_openmetrics_samples(std::string &out) const override;
+    void reset() noexcept override;
+    void collect_and_reset(std::string &out) override;
+
+private:
+    static constexpr int windows = 3;
+
+    void start() noexcept;
+    void advance(int64_t now) const noexcept;
+
+    const std::string name_;
+    alignas(cache_line_size) std::atomic<uint64_t> count_{0};
+    // Everything below belongs to readers. ticking_ admits one of them to
+    // advance the averages; counted_ is only touched while holding it.
+    alignas(cache_line_size) mutable std::atomic<bool> ticking_{false};
+    mutable uint64_t counted_ = 0;
+    mutable bool primed_ = false;
+    mutable std::atomic<int64_t> last_tick_{0};
+    mutable std::atomic<double> rates_[windows] = {};
+    std::atomic<int64_t> started_{0};
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef NATIVE_HISTOGRAM_HPP_
+#define NATIVE_HISTOGRAM_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "format.hpp"
+#include "metric.hpp"
+
+namespace metrics {
+
+// Histogram with exponential buckets of base 2^(2^-schema) and no predefined
+// bounds, in the spirit of Prometheus native histograms. Every observation
+// lands in a bucket whose bounds are within a fixed relative error of the
+// value. Buckets are allocated lazily in chunks of eight powers of two, so
+// unused ranges cost nothing.
+class NativeHistogram : public Metric {
+public:
+    static constexpr int min_schema = 0;
+    static constexpr int max_schema = 8;
+    static constexpr int default_schema = 3;
+
+    // Magnitudes at or below 2^-octave_limit are counted in the zero bucket.
+    // Values above 2^octave_limit have no bucket and count only towards +Inf
+    // and the total; values below -2^octave_limit share a lowest bucket that
+    // is open towards -Inf.
+    static constexpr int octave_limit = 128;
+
+    struct Bucket {
+        double lower;
+        double upper;
+        uint64_t count;
+    };
+
+    struct Snapshot {
+        double sum;
+        uint64_t count;
+        int schema;
+        std::vector<Bucket> buckets;
+        // Cumulative counts of the buckets; count adds overflow on top.
+        std::vector<uint64_t> cumulative;
+        // Observations above 2^octave_limit, in no finite bucket.
+        uint64_t overflow;
+
+        double quantile(double q) const noexcept;
+    };
+
+    template <typename S>
+        requires std::is_convertible_v<S, std::string>
+    explicit NativeHistogram(S &&name, int schema = default_schema)
+        : name_(std::forward<S>(name)),
+          schema_(std::clamp(schema, min_schema, max_schema)) {
+    }
+
+    NativeHistogram() = delete;
+    NativeHistogram(const NativeHistogram &) = delete;
+    NativeHistogram(NativeHistogram &&) = delete;
+    NativeHistogram &operator=(const NativeHistogram &) = delete;
+    NativeHistogram &operator=(NativeHistogram &&) = delete;
+    ~NativeHistogram() override;
+
+    void observe(double value) noexcept;
+    Snapshot get() const;
+
+    int schema() const noexcept;
+    double relative_error() const noexcept;
+
+    std::string_view name() const noexcept override;
+    void append_to(std::string &out) const override;
+    std::string_view openmetrics_type() const noexcept override;
+    void append_openmetrics_samples(std::string &out) const override;
+    void reset() noexcept override;
+    void collect_and_reset(std::string &out) override;
+    bool consume_changed() noexcept override;
+
+private:
+    static constexpr int octaves_per_chunk = 8;
+    static constexpr int chunks = 2 * octave_limit / octaves_per_chunk;
+
+    using Chunk = std::atomic<uint64_t>;
+    using Directory = std::array<std::atomic<Chunk *>, chunks>;
+
+    std::size_t chunk_length() const noexcept;
+    void increment(Directory &directory, std::size_t slot) noexcept;
+    // With clear set every count is taken with exchange, so an observation
+    // lands in exactly one snapshot, though its sum and bucket may end up
+    // in consecutive ones.
+    void collect(
+        const Directory &directory,
+        bool negative,
+        bool clear,
+        Snapshot &out
+    ) const;
+    Snapshot read(bool clear) const;
+    void append_snapshot(std::string &out, const Snapshot &snapshot) const;
+
+    const std::string name_;
+    const int schema_;
+    Directory positive_{};
+    Directory negative_{};
+    // Mutable like the chunks behind the directories, so that read() can
+    // clear them.
+    mutable std::atomic<uint64_t> zero_count_{0};
+    mutable std::atomic<uint64_t> overflow_count_{0};
+    mutable std::atomic<uint64_t> underflow_count_{0};
+    mutable std::atomic<double> sum_{0.0};
+    ChangeFlag changed_;
+};
+
+}  // namespace metrics
+
+#endif
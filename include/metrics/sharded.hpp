@@ -0,0 +1,97 @@
+#ifndef SHARDED_HPP_
+#define SHARDED_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace metrics {
+
+inline constexpr std::size_t cache_line_size = 64;
+
+// Index of the calling thread, assigned round-robin on first use. Threads
+// keep their index for life, so consecutive threads land on distinct shards.
+inline std::size_t this_thread_index() noexcept {
+    static std::atomic<std::size_t> next{0};
+    thread_local const std::size_t index =
+        next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+// Drop-in replacement for std::atomic<N> as the storage parameter of Counter
+// and Gauge. Every thread updates its own cache-line-sized slot; reads sum
+// the slots. fetch_add/fetch_sub return the previous value of the caller's
+// slot only, not of the whole sum.
+template <typename N = uint64_t, std::size_t Shards = 32>
+class ShardedAtomic {
+public:
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0,
+                  "Shards must be a power of two");
+
+    ShardedAtomic() noexcept = default;
+
+    ShardedAtomic(const ShardedAtomic &) = delete;
+    ShardedAtomic &operator=(const ShardedAtomic &) = delete;
+
+    N fetch_add(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        return local().fetch_add(v, order);
+    }
+
+    N fetch_sub(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        return local().fetch_sub(v, order);
+    }
+
+    N load(std::memory_order order = std::memory_order_seq_cst
+    ) const noexcept {
+        N sum{};
+        for (const auto &slot : slots_) {
+            sum += slot.value.load(order);
+        }
+        return sum;
+    }
+
+    void store(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        auto &own = local();
+        for (auto &slot : slots_) {
+            if (&slot.value != &own) {
+                slot.value.store(N{}, order);
+            }
+        }
+        own.store(v, order);
+    }
+
+    N exchange(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        auto &own = local();
+        N sum{};
+        for (auto &slot : slots_) {
+            if (&slot.value != &own) {
+                sum += slot.value.exchange(N{}, order);
+            }
+        }
+        return sum + own.exchange(v, order);
+    }
+
+    operator N() const noexcept {
+        return load();
+    }
+
+private:
+    struct alignas(cache_line_size) Slot {
+        std::atomic<N> value{};
+    };
+
+    std::atomic<N> &local() noexcept {
+        return slots_[this_thread_index() & (Shards - 1)].value;
+    }
+
+    std::array<Slot, Shards> slots_{};
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef STATIC_SET_HPP_
+#define STATIC_SET_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "format.hpp"
+#include "metric.hpp"
+#include "openmetrics.hpp"
+#include "sharded.hpp"
+
+namespace metrics {
+
+// String literal usable as a template argument: StaticCounter<"hits_total">.
+template <std::size_t N>
+struct FixedString {
+    constexpr FixedString(const char (&text)[N]) noexcept {
+        std::copy_n(text, N, value);
+    }
+
+    constexpr std::string_view view() const noexcept {
+        return {value, N - 1};
+    }
+
+    char value[N]{};
+};
+
+// Fields of a StaticMetricSet. Counters only go up; gauges can also be set
+// and decremented. Both are reset by a flush, like Counter and Gauge.
+template <FixedString Name, typename N = uint64_t>
+struct StaticCounter {
+    using value_type = N;
+    static constexpr std::string_view name = Name.view();
+    static constexpr bool monotonic = true;
+};
+
+template <FixedString Name, typename N = int64_t>
+struct StaticGauge {
+    using value_type = N;
+    static constexpr std::string_view name = Name.view();
+    static constexpr bool monotonic = false;
+};
+
+// A schema of counters and gauges fixed at compile time, e.g.
+//
+//   using Http = StaticMetricSet<"http", StaticCounter<"requests_total">,
+//                                StaticGauge<"connections">>;
+//   auto http = std::make_shared<Http>();
+//   collector.register_metric(http);
+//   http->inc<"requests_total">();
+//
+// The values are one block of atomics on their own cache lines, with no
+// allocation or shared_ptr per field. Fields are picked by name at compile
+// time, so an update is the same atomic operation as on a Counter, and a
+// misspelt name does not compile. The set is registered and written as one
+// metric, like a Family: `"http" {"requests_total" 1 "connections" 2}`,
+// from a loop generated for the schema, with one virtual call per flush for
+// the whole set. Fields that share one cache line should not all be hot in
+// different threads; use a ShardedCounter for such a metric instead.
+template <FixedString Name, typename... Fields>
+class StaticMetricSet : public Metric {
+    static_assert(sizeof...(Fields) > 0, "a metric set needs a field");
+
+    static constexpr std::string_view names_[] = {Fields::name...};
+
+    static consteval bool names_unique() {
+        for (std::size_t i = 0; i < sizeof...(Fields); ++i) {
+            for (std::size_t j = 0; j < i; ++j) {
+                if (names_[i] == names_[j]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static_assert(names_unique(), "metric names in a set must be unique");
+
+    template <FixedString Field>
+    static consteval std::size_t index_of() {
+        for (std::size_t i = 0; i < sizeof...(Fields); ++i) {
+            if (names_[i] == Field.view()) {
+                return i;
+            }
+        }
+        return sizeof...(Fields);
+    }
+
+    template <FixedString Field>
+    static constexpr std::size_t field_index = index_of<Field>();
+
+    // An unknown name maps to the last field here, so that the signatures
+    // stay valid and slot() reports the error.
+    template <FixedString Field>
+    using field_t = std::tuple_element_t<
+        std::min(field_index<Field>, sizeof...(Fields) - 1),
+        std::tuple<Fields...>>;
+
+    template <FixedString Field>
+    using value_t = typename field_t<Field>::value_type;
+
+public:
+    StaticMetricSet() noexcept = default;
+
+    StaticMetricSet(const StaticMetricSet &) = delete;
+    StaticMetricSet &operator=(const StaticMetricSet &) = delete;
+
+    template <FixedString Field>
+    value_t<Field> inc() noexcept {
+        return inc_by<Field>(value_t<Field>{1});
+    }
+
+    template <FixedString Field>
+    value_t<Field> inc_by(value_t<Field> v) noexcept {
+        const auto previous =
+            slot<Field>().fetch_add(v, std::memory_order_relaxed);
+        changed_.mark();
+        return previous;
+    }
+
+    template <FixedString Field>
+        requires(!field_t<Field>::monotonic)
+    value_t<Field> dec() noexcept {
+        return dec_by<Field>(value_t<Field>{1});
+    }
+
+    template <FixedString Field>
+        requires(!field_t<Field>::monotonic)
+    value_t<Field> dec_by(value_t<Field> v) noexcept {
+        const auto previous =
+            slot<Field>().fetch_sub(v, std::memory_order_relaxed);
+        changed_.mark();
+        return previous;
+    }
+
+    template <FixedString Field>
+        requires(!field_t<Field>::monotonic)
+    void set(value_t<Field> v) noexcept {
+        slot<Field>().store(v, std::memory_order_relaxed);
+        changed_.mark();
+    }
+
+    template <FixedString Field>
+    value_t<Field> get() const noexcept {
+        return slot<Field>().load(std::memory_order_relaxed);
+    }
+
+    static constexpr std::size_t size() noexcept {
+        return sizeof...(Fields);
+    }
+
+    std::string_view name() const noexcept override {
+        return Name.view();
+    }
+
+    void append_to(std::string &out) const override {
+        append_fields(out, values_, std::index_sequence_for<Fields...>{});
+    }
+
+    // Every field is a family of its own, named after the set and the field,
+    // e.g. http_requests_total and http_connections, so the set writes its
+    // TYPE lines.
+    std::string_view openmetrics_type() const noexcept override {
+        return {};
+    }
+
+    void append_openmetrics_samples(std::string &out) const override {
+        append_families(out, std::index_sequence_for<Fields...>{});
+    }
+
+    void reset() noexcept override {
+        if (clear_fields(std::index_sequence_for<Fields...>{})) {
+            changed_.mark();
+        }
+    }
+
+    void collect_and_reset(std::string &out) override {
+        if (append_fields(out, values_, std::index_sequence_for<Fields...>{})) {
+            changed_.mark();
+        }
+    }
+
+    bool consume_changed() noexcept override {
+        return changed_.consume();
+    }
+
+private:
+    using Values = std::tuple<std::atomic<typename Fields::value_type>...>;
+
+    template <FixedString Field>
+    auto &slot() noexcept {
+        static_assert(
+            field_index<Field> < sizeof...(Fields), "no such metric in the set"
+        );
+        return std::get<field_index<Field>>(values_);
+    }
+
+    template <FixedString Field>
+    const auto &slot() const noexcept {
+        static_assert(
+            field_index<Field> < sizeof...(Fields), "no such metric in the set"
+        );
+        return std::get<field_index<Field>>(values_);
+    }
+
+    // Writes the set as `{"a" 1 "b" 2}`, taking the values with exchange
+    // unless they are const. Returns whether any of them was non-zero.
+    template <typename V, std::size_t... I>
+    static bool
+    append_fields(std::string &out, V &values, std::index_sequence<I...>) {
+        constexpr bool clear = !std::is_const_v<V>;
+        bool any = false;
+        out += '{';
+        (
+            [&] {
+                using N = typename Fields::value_type;
+                auto &value = std::get<I>(values);
+                N current;
+                if constexpr (clear) {
+                    current = value.exchange(N{}, std::memory_order_relaxed);
+                } else {
+                    current = value.load(std::memory_order_relaxed);
+                }
+                any |= current != N{};
+                out += I == 0 ? "\"" : " \"";
+                out += Fields::name;
+                out += "\" ";
+                append_number(out, current);
+            }(),
+            ...
+        );
+        out += '}';
+        return any;
+    }
+
+    template <std::size_t... I>
+    bool clear_fields(std::index_sequence<I...>) noexcept {
+        bool any = false;
+        ((any |= std::get<I>(values_).exchange(
+                     typename Fields::value_type{}, std::memory_order_relaxed
+                 ) != typename Fields::value_type{}),
+         ...);
+        return any;
+    }
+
+    // "<set>_<field>", built at compile time so that exposition does not
+    // allocate a name per field.
+    template <typename Field>
+    static constexpr auto prefixed_name_ = [] {
+        constexpr std::string_view set = Name.view();
+        std::array<char, set.size() + 1 + Field::name.size()> text{};
+        auto end = std::copy(set.begin(), set.end(), text.begin());
+        *end++ = '_';
+        std::copy(Field::name.begin(), Field::name.end(), end);
+        return text;
+    }();
+
+    template <std::size_t... I>
+    void append_families(std::string &out, std::index_sequence<I...>) const {
+        (
+            [&] {
+                const auto value =
+                    std::get<I>(values_).load(std::memory_order_relaxed);
+                const auto &text = prefixed_name_<Fields>;
+                const std::string_view name{text.data(), text.size()};
+                if constexpr (Fields::monotonic) {
+                    const MetricName family{strip_suffix(name, "_total"), {}};
+                    append_type_line(out, family.family, "counter");
+                    append_value_sample(out, family, "_total", value);
+                } else {
+                    append_type_line(out, name, "gauge");
+                    append_value_sample(out, {name, {}}, {}, value);
+                }
+            }(),
+            ...
+        );
+    }
+
+    alignas(cache_line_size) Values values_{};
+    ChangeFlag changed_;
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef SUMMARY_HPP_
+#define SUMMARY_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "format.hpp"
+#include "metric.hpp"
+#include "sharded.hpp"
+
+namespace metrics {
+
+// DDSketch: values are counted in logarithmic bins of base
+// gamma = (1 + a) / (1 - a), so every quantile is answered with relative
+// error at most a. Sketches with the same accuracy merge bin-by-bin. When a
+// sketch needs more than max_bins bins, the bins closest to zero collapse
+// into one, which keeps memory bounded and the upper quantiles exact.
+class QuantileSketch {
+public:
+    explicit QuantileSketch(
+        double relative_accuracy = 0.01,
+        std::size_t max_bins = 2048
+    );
+
+    void add(double value, uint64_t count = 1);
+    void merge(const QuantileSketch &other);
+    void clear() noexcept;
+
+    double quantile(double q) const noexcept;
+    uint64_t count() const noexcept;
+    double sum() const noexcept;
+    double relative_accuracy() const noexcept;
+
+private:
+    struct Store {
+        std::vector<uint64_t> bins;
+        int offset = 0;
+
+        void add(int index, uint64_t count, std::size_t max_bins);
+    };
+
+    int index_of(double magnitude) const noexcept;
+    double value_of(int index) const noexcept;
+
+    double relative_accuracy_;
+    double gamma_;
+    double inv_log_gamma_;
+    std::size_t max_bins_;
+    Store positive_;
+    Store negative_;
+    uint64_t zero_count_ = 0;
+    uint64_t count_ = 0;
+    double sum_ = 0.0;
+};
+
+struct SummaryOptions {
+    double relative_accuracy = 0.01;
+    std::size_t max_bins = 2048;
+    // Zero keeps every observation since the last reset or flush; otherwise
+    // only the last max_age of observations, expired in age_buckets steps.
+    // A flush does not clear a windowed summary, so every flush reports the
+    // whole window.
+    std::chrono::milliseconds max_age{0};
+    std::size_t age_buckets = 5;
+};
+
+class Summary : public Metric {
+public:
+    template <typename S>
+        requires std::is_convertible_v<S, std::string>
+    explicit Summary(
+        S &&name,
+        std::vector<double> quantiles = {0.5, 0.9, 0.99},
+        SummaryOptions options = {}
+    )
+        : name_(std::forward<S>(name)),
+          quantiles_(std::move(quantiles)),
+          options_(options) {
+        init();
+    }
+
+    Summary() = delete;
+    Summary(const Summary &) = delete;
+    Summary(Summary &&) = delete;
+    Summary &operator=(const Summary &) = delete;
+    Summary &operator=(Summary &&) = delete;
+
+    void observe(double value);
+    QuantileSketch get() const;
+
+    const std::vector<double> &quantiles() const noexcept;
+
+    std::string_view name() const noexcept override;
+    void append_to(std::string &out) const override;
+    std::string_view openmetrics_type() const noexcept override;
+    void append_openmetrics_samples(std::string &out) const override;
+    void reset() noexcept override;
+    void collect_and_reset(std::string &out) override;
+    bool consume_changed() noexcept override;
+
+private:
+    static constexpr std::size_t shard_count = 8;
+
+    // Observations go to a per-thread shard; shards are folded into the
+    // time window they were recorded in when their window closes or when
+    // the summary is read.
+    struct alignas(cache_line_size) Shard {
+        std::mutex mutex;
+        QuantileSketch sketch;
+        int64_t epoch = 0;
+    };
+
+    struct Window {
+        QuantileSketch sketch;
+        int64_t epoch = -1;
+    };
+
+    void init();
+    int64_t current_epoch() const noexcept;
+    void drain(Shard &shard) const;
+    // Merges the live windows; with clear set also empties every window
+    // under the same lock. Observations still in a shard then stay there
+    // for the next call.
+    QuantileSketch fold(bool clear) const;
+    void append_sketch(std::string &out, const QuantileSketch &sketch) const;
+
+    const std::string name_;
+    const std::vector<double> quantiles_;
+    const SummaryOptions options_;
+    std::unique_ptr<Shard[]> shards_;
+    mutable std::mutex windows_mutex_;
+    mutable std::vector<Window> windows_;
+    ChangeFlag changed_;
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef MPMC_QUEUE_HPP_
+#define MPMC_QUEUE_HPP_
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include "sharded.hpp"
+
+namespace metrics {
+
+// Bounded lock-free queue after Dmitry Vyukov's array-based design: every
+// slot carries a sequence number telling producers and consumers whose
+// turn it is, so a push or pop is one CAS on a position plus a store to
+// the slot. Producers never wait for each other beyond that CAS.
+//
+// Both ends are multi-threaded: try_push and try_pop may each be called
+// from any number of threads. The collector's writer thread is the regular
+// consumer, but with QueuePolicy::DropOldest a producer that finds the
+// queue full pops the oldest element itself to make room, so producers
+// are consumers too and a single-consumer queue would not do. Neither
+// call blocks. While the element at the head has been
+// claimed by a producer that has not finished writing it, try_pop fails,
+// and when the queue is full try_push fails too; callers that retry must
+// back off and let that producer run.
+template <typename T>
+class BoundedMpmcQueue {
+public:
+    // The capacity is rounded up to a power of two, at least 2.
+    explicit BoundedMpmcQueue(std::size_t capacity)
+        : mask_(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1),
+          slots_(std::make_unique<Slot[]>(mask_ + 1)),
+          tail_(0),
+          head_(0) {
+        for (std::size_t i = 0; i <= mask_; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpmcQueue(const BoundedMpmcQueue &) = delete;
+    BoundedMpmcQueue &operator=(const BoundedMpmcQueue &) = delete;
+
+    // Moves from value only when there is room; returns false otherwise.
+    bool try_push(T &value) {
+        std::size_t position = tail_.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots_[position & mask_];
+            const std::size_t sequence =
+                slot->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::ptrdiff_t>(sequence - position);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed
+                    )) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &out) {
+        std::size_t position = head_.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots_[position & mask_];
+            const std::size_t sequence =
+                slot->sequence.load(std::memory_order_acquire);
+            const auto diff =
+                static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed
+                    )) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+        out = std::move(slot->value);
+        slot->sequence.store(position + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Elements claimed by producers and not yet popped. A claimed element
+    // may still be being written, in which case try_pop fails for a moment.
+    std::size_t size() const noexcept {
+        const std::size_t head = head_.load(std::memory_order_acquire);
+        const std::size_t tail = tail_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    std::size_t capacity() const noexcept {
+        return mask_ + 1;
+    }
+
+private:
+    struct alignas(cache_line_size) Slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    const std::size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(cache_line_size) std::atomic<std::size_t> tail_;
+    alignas(cache_line_size) std::atomic<std::size_t> head_;
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef OPENMETRICS_HPP_
+#define OPENMETRICS_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "format.hpp"
+#include "metric.hpp"
+
+namespace metrics {
+
+// Helpers for the OpenMetrics text exposition format. A metric name may
+// carry labels, as the children of Family do: `requests{route="/"}` is the
+// family `requests` with the label set `route="/"`.
+struct MetricName {
+    std::string_view family;
+    std::string_view labels;
+};
+
+inline MetricName split_metric_name(std::string_view name) noexcept {
+    const auto brace = name.find('{');
+    if (brace == std::string_view::npos || name.back() != '}') {
+        return {name, {}};
+    }
+    return {
+        name.substr(0, brace), name.substr(brace + 1, name.size() - brace - 2)
+    };
+}
+
+// Family name without a suffix the format reserves for samples, e.g.
+// `_total` for counters.
+inline std::string_view
+strip_suffix(std::string_view family, std::string_view suffix) noexcept {
+    if (family.size() > suffix.size() && family.ends_with(suffix)) {
+        family.remove_suffix(suffix.size());
+    }
+    return family;
+}
+
+// Appends name with every character outside [a-zA-Z0-9_:] replaced by '_'.
+inline void append_metric_name(std::string &out, std::string_view name) {
+    for (std::size_t i = 0; i < name.size(); ++i) {
+        const char c = name[i];
+        const bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                           c == '_' || c == ':' ||
+                           (i > 0 && c >= '0' && c <= '9');
+        out += valid ? c : '_';
+    }
+}
+
+inline void append_type_line(
+    std::string &out,
+    std::string_view family,
+    std::string_view type
+) {
+    out += "# TYPE ";
+    append_metric_name(out, family);
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// Appends `family+suffix{labels,extra} ` ready for the value.
+inline void append_sample_name(
+    std::string &out,
+    std::string_view family,
+    std::string_view suffix,
+    std::string_view labels,
+    std::string_view extra = {}
+) {
+    append_metric_name(out, family);
+    out += suffix;
+    if (!labels.empty() || !extra.empty()) {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extra.empty()) {
+            out += ',';
+        }
+        out += extra;
+        out += '}';
+    }
+    out += ' ';
+}
+
+template <typename N>
+void append_openmetrics_value(std::string &out, const N &value) {
+    if constexpr (std::is_floating_point_v<N>) {
+        if (std::isnan(value)) {
+            out += "NaN";
+            return;
+        }
+        if (std::isinf(value)) {
+            out += value > 0 ? "+Inf" : "-Inf";
+            return;
+        }
+    }
+    append_number(out, value);
+}
+
+// Histogram bucket sample `family_bucket{labels,le="bound"} count`.
+inline void append_bucket_sample(
+    std::string &out,
+    const MetricName &name,
+    double bound,
+    uint64_t cumulative
+) {
+    std::string le = "le=\"";
+    append_openmetrics_value(le, bound);
+    le += '"';
+    append_sample_name(out, name.family, "_bucket", name.labels, le);
+    append_number(out, cumulative);
+    out += '\n';
+}
+
+// Plain `family+suffix{labels} value` sample.
+template <typename N>
+void append_value_sample(
+    std::string &out,
+    const MetricName &name,
+    std::string_view suffix,
+    const N &value
+) {
+    append_sample_name(out, name.family, suffix, name.labels);
+    append_openmetrics_value(out, value);
+    out += '\n';
+}
+
+// `# TYPE` line followed by the samples of one metric.
+inline void append_openmetrics(std::string &out, const Metric &metric) {
+    const auto type = metric.openmetrics_type();
+    if (type.empty()) {
+        metric.append_openmetrics_samples(out);
+        return;
+    }
+    auto family = split_metric_name(metric.name()).family;
+    if (type == "counter") {
+        family = strip_suffix(family, "_total");
+    } else if (type == "info") {
+        family = strip_suffix(family, "_info");
+    }
+    append_type_line(out, family, type);
+    metric.append_openmetrics_samples(out);
+}
+
+}  // namespace metrics
+
+#endif
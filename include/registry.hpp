@@ -0,0 +1,176 @@
+#ifndef REGISTRY_HPP_
+#define REGISTRY_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "metric.hpp"
+
+namespace metrics {
+
+// Metrics of one ScalarType, as parallel arrays in registration order.
+template <typename N>
+struct ScalarColumn {
+    std::vector<std::atomic<N> *> values;
+    std::vector<ChangeFlag *> changed;
+    // The ` "name" ` prefix of every metric as the collector writes it,
+    // back to back; label_ends[i] is where the i-th one ends.
+    std::string labels;
+    std::vector<std::size_t> label_ends;
+    // Scratch space for the flush that uses the column.
+    std::vector<std::size_t> taken;
+    std::vector<N> taken_values;
+
+    std::size_t size() const noexcept {
+        return values.size();
+    }
+
+    void clear() noexcept {
+        values.clear();
+        changed.clear();
+        labels.clear();
+        label_ends.clear();
+    }
+};
+
+// Strongly held plain Counters and Gauges, see Metric::scalar_slot.
+struct ScalarColumns {
+    ScalarColumn<uint64_t> unsigned_values;
+    ScalarColumn<int64_t> signed_values;
+    ScalarColumn<double> double_values;
+};
+
+// Metrics indexed by name. Entries sit in one vector in registration
+// order, each caching the raw pointer, so a pass over the registry walks
+// contiguous memory and only touches a control block for weak entries.
+// A hash index maps names to positions. Removal leaves a hole that the
+// next mutable pass compacts, which keeps removal O(1) and the order
+// stable. Not thread-safe: MetricsCollector guards it with its mutex.
+//
+// For flushing, strongly held metrics with a scalar slot are also sorted
+// into ScalarColumns, rebuilt on the first use after such a metric was
+// added or removed; every other metric is visited by for_each_other.
+class MetricRegistry {
+public:
+    MetricRegistry() = default;
+
+    MetricRegistry(const MetricRegistry &) = delete;
+    MetricRegistry &operator=(const MetricRegistry &) = delete;
+
+    // Keeps the metric alive until it is removed. Adding the same metric
+    // again does nothing, except that a weak entry becomes a strong one.
+    // Throws std::invalid_argument when another live metric has the name.
+    void add(std::shared_ptr<Metric> metric);
+
+    // Like add, but holds the metric weakly: once every other owner lets
+    // go, the entry is dropped by the next pass.
+    void add_weak(const std::shared_ptr<Metric> &metric);
+
+    // Returns false if no live metric has the name.
+    bool remove(std::string_view name);
+
+    std::shared_ptr<Metric> find(std::string_view name) const;
+
+    // Registered metrics, expired weak ones included until the next pass.
+    std::size_t size() const noexcept;
+
+    // Calls f with every live metric in registration order and compacts
+    // the entries of removed and expired metrics.
+    template <typename F>
+    void for_each(F &&f) {
+        for (auto &entry : entries_) {
+            if (entry.metric == nullptr) {
+                continue;
+            }
+            if (entry.owner) {
+                f(*entry.metric);
+            } else if (auto alive = entry.watched.lock()) {
+                f(*alive);
+            } else {
+                drop(entry);
+            }
+        }
+        if (holes_ > 0) {
+            compact();
+        }
+    }
+
+    // for_each restricted to the metrics that are not in scalar_columns().
+    template <typename F>
+    void for_each_other(F &&f) {
+        for (auto &entry : entries_) {
+            if (entry.metric == nullptr ||
+                entry.scalar.type != ScalarType::None) {
+                continue;
+            }
+            if (entry.owner) {
+                f(*entry.metric);
+            } else if (auto alive = entry.watched.lock()) {
+                f(*alive);
+            } else {
+                drop(entry);
+            }
+        }
+        if (holes_ > 0) {
+            compact();
+        }
+    }
+
+    ScalarColumns &scalar_columns();
+
+    template <typename F>
+    void for_each(F &&f) const {
+        for (const auto &entry : entries_) {
+            if (entry.metric == nullptr) {
+                continue;
+            }
+            if (entry.owner) {
+                f(*entry.metric);
+            } else if (auto alive = entry.watched.lock()) {
+                f(*alive);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        // nullptr once removed.
+        Metric *metric;
+        // Exactly one of these is set while the entry is live.
+        std::shared_ptr<Metric> owner;
+        std::weak_ptr<Metric> watched;
+        // Points at the key of the index node.
+        std::string_view name;
+        // Set only for strong entries.
+        ScalarSlot scalar;
+    };
+
+    struct NameHash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view name) const noexcept {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    void insert(std::shared_ptr<Metric> metric, bool weak);
+    void drop(Entry &entry) noexcept;
+    void compact();
+
+    std::vector<Entry> entries_;
+    std::unordered_map<std::string, std::size_t, NameHash, std::equal_to<>>
+        index_;
+    std::size_t holes_ = 0;
+    ScalarColumns columns_;
+    bool columns_stale_ = false;
+};
+
+}  // namespace metrics
+
+#endif
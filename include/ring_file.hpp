@@ -0,0 +1,73 @@
+#ifndef RING_FILE_HPP_
+#define RING_FILE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace metrics {
+
+// Fixed-size memory-mapped file used as a ring buffer of records. Appending
+// is a memcpy into the shared mapping, so records survive a crash of the
+// writing process as soon as append() returns.
+//
+// The file is a header page followed by the data area. The header holds
+// the data size and the head and tail positions; positions grow
+// monotonically and wrap modulo the data size. Every record is
+// [u32 length][u32 crc32][u64 sequence][payload], padded to 8 bytes, and
+// never straddles the end of the data area. The tail moves past the oldest
+// records before their space is reused and the head is published only
+// after the new record is complete, so the range between them always holds
+// whole records.
+class RingFile {
+public:
+    static constexpr std::size_t header_size = 4096;
+
+    // Opens path, creating or reinitialising it when it is not a ring of
+    // the same capacity. An existing ring keeps its records. Throws
+    // std::system_error when the file cannot be opened or mapped.
+    RingFile(const std::string &path, std::size_t capacity);
+    ~RingFile();
+
+    RingFile(const RingFile &) = delete;
+    RingFile &operator=(const RingFile &) = delete;
+
+    // Returns false if the record does not fit in the data area.
+    bool append(std::string_view record);
+
+    // Flushes the mapping to disk; only needed to survive power loss.
+    void sync();
+
+    std::size_t capacity() const noexcept;
+
+private:
+    char *data() const noexcept;
+    void initialise() noexcept;
+
+    std::mutex mutex_;
+    std::size_t capacity_;
+    std::size_t mapping_size_;
+    void *mapping_;
+};
+
+struct RingRecord {
+    uint64_t sequence;
+    std::string data;
+};
+
+// Reads the records of a ring file, oldest first, keeping at most the last
+// max_records. Reading stops at the first record that fails its checksum,
+// e.g. one being written concurrently. Throws std::system_error if the file
+// cannot be read and std::runtime_error if it is not a ring file.
+std::vector<RingRecord> read_ring_file(
+    const std::string &path,
+    std::size_t max_records = std::numeric_limits<std::size_t>::max()
+);
+
+}  // namespace metrics
+
+#endif
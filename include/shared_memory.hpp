@@ -0,0 +1,195 @@
+#ifndef SHARED_MEMORY_HPP_
+#define SHARED_MEMORY_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "counter.hpp"
+#include "gauge.hpp"
+#include "histogram.hpp"
+
+namespace metrics {
+
+// Atomic living in memory owned by someone else, used as the A parameter of
+// Counter and Gauge. owner keeps the memory alive as long as the metric.
+template <typename N>
+class SharedAtomic {
+public:
+    SharedAtomic(std::atomic<N> *value, std::shared_ptr<void> owner) noexcept
+        : value_(value), owner_(std::move(owner)) {
+    }
+
+    N fetch_add(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        return value_->fetch_add(v, order);
+    }
+
+    N fetch_sub(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        return value_->fetch_sub(v, order);
+    }
+
+    N load(std::memory_order order = std::memory_order_seq_cst
+    ) const noexcept {
+        return value_->load(order);
+    }
+
+    void store(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        value_->store(v, order);
+    }
+
+    N exchange(N v, std::memory_order order = std::memory_order_seq_cst
+    ) noexcept {
+        return value_->exchange(v, order);
+    }
+
+    operator N() const noexcept {
+        return load();
+    }
+
+private:
+    std::atomic<N> *value_;
+    std::shared_ptr<void> owner_;
+};
+
+enum class SharedMetricType : uint8_t { Counter = 1, Gauge = 2, Histogram = 3 };
+enum class SharedValueType : uint8_t { Unsigned = 1, Signed = 2, Double = 3 };
+
+// Places the storage of metrics in a named POSIX shared memory object, so
+// another process can read live values with SharedMemoryReader while the
+// owning process does no extra work: the metrics update the shared atomics
+// directly.
+//
+// The segment starts with a header (magic, size, number of entries) and
+// is followed by one self-describing entry per metric: its size, type,
+// value type, name, histogram bounds and then the 8-byte value slots.
+// Entries are only appended, and the entry count is published after the
+// entry is complete. The object is unlinked when the exporter and every
+// metric created by it are destroyed.
+class SharedMemoryExporter {
+public:
+    static constexpr std::size_t default_size = 1 << 20;
+
+    // name is a shm_open name such as "/service-metrics"; an existing object
+    // is replaced. Throws std::system_error on failure.
+    explicit SharedMemoryExporter(
+        std::string name,
+        std::size_t size = default_size
+    );
+
+    SharedMemoryExporter(const SharedMemoryExporter &) = delete;
+    SharedMemoryExporter &operator=(const SharedMemoryExporter &) = delete;
+
+    // These throw std::length_error when the segment is full.
+    template <typename N = uint64_t>
+    std::shared_ptr<Counter<N, SharedAtomic<N>>> counter(std::string name) {
+        auto *slot = allocate_value<N>(SharedMetricType::Counter, name);
+        return std::make_shared<Counter<N, SharedAtomic<N>>>(
+            std::move(name), SharedAtomic<N>(slot, segment_)
+        );
+    }
+
+    template <typename N = uint64_t>
+    std::shared_ptr<Gauge<N, SharedAtomic<N>>> gauge(std::string name) {
+        auto *slot = allocate_value<N>(SharedMetricType::Gauge, name);
+        return std::make_shared<Gauge<N, SharedAtomic<N>>>(
+            std::move(name), SharedAtomic<N>(slot, segment_)
+        );
+    }
+
+    std::shared_ptr<Histogram>
+    histogram(std::string name, std::vector<double> buckets);
+
+    const std::string &name() const noexcept;
+
+private:
+    class Segment;
+
+    template <typename N>
+    std::atomic<N> *
+    allocate_value(SharedMetricType type, std::string_view name) {
+        static_assert(
+            std::is_arithmetic_v<N> && sizeof(N) == 8 &&
+                std::atomic<N>::is_always_lock_free,
+            "shared metrics hold 8-byte lock-free arithmetic values"
+        );
+        SharedValueType value_type = SharedValueType::Unsigned;
+        if constexpr (std::is_floating_point_v<N>) {
+            value_type = SharedValueType::Double;
+        } else if constexpr (std::is_signed_v<N>) {
+            value_type = SharedValueType::Signed;
+        }
+        void *slot = allocate(type, value_type, name, {}, 1);
+        return new (slot) std::atomic<N>(N{});
+    }
+
+    // Appends an entry and returns its zeroed value slots.
+    void *allocate(
+        SharedMetricType type,
+        SharedValueType value_type,
+        std::string_view name,
+        std::span<const double> bounds,
+        std::size_t slots
+    );
+
+    std::shared_ptr<Segment> segment_;
+};
+
+// A metric in a segment mapped by SharedMemoryReader.
+class SharedMetricView {
+public:
+    std::string_view name() const noexcept;
+    SharedMetricType type() const noexcept;
+    SharedValueType value_type() const noexcept;
+
+    // Current counter or gauge value, converted from value_type().
+    uint64_t as_unsigned() const noexcept;
+    int64_t as_signed() const noexcept;
+    double as_double() const noexcept;
+
+    // Histogram bounds with +Inf last, the count of observations in each
+    // bucket (not cumulative) and the sum of observations.
+    std::span<const double> bounds() const noexcept;
+    uint64_t bucket_count(std::size_t bucket) const noexcept;
+    double sum() const noexcept;
+
+private:
+    friend class SharedMemoryReader;
+
+    explicit SharedMetricView(const char *entry) noexcept;
+
+    uint64_t slot(std::size_t index) const noexcept;
+
+    const char *entry_;
+};
+
+class SharedMemoryReader {
+public:
+    // Maps the segment read-only. Throws std::system_error if it cannot be
+    // opened and std::runtime_error if it is not a metrics segment.
+    explicit SharedMemoryReader(const std::string &name);
+    ~SharedMemoryReader();
+
+    SharedMemoryReader(const SharedMemoryReader &) = delete;
+    SharedMemoryReader &operator=(const SharedMemoryReader &) = delete;
+
+    // Metrics exported so far. Views stay valid while the reader lives and
+    // always show the current values.
+    std::vector<SharedMetricView> metrics() const;
+
+private:
+    const char *mapping_;
+    std::size_t size_;
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef TIMESTAMP_HPP_
+#define TIMESTAMP_HPP_
+
+#include <chrono>
+#include <ctime>
+#include <string>
+
+namespace metrics {
+
+enum class TimestampFormat {
+    // "YYYY-MM-DD HH:MM:SS.mmm" in local time.
+    LocalTime,
+    // Nanoseconds since the Unix epoch as a decimal integer.
+    EpochNanos,
+};
+
+// Formats flush timestamps without iostreams. In LocalTime mode the
+// "YYYY-MM-DD HH:MM:SS" prefix is computed once per second and only the
+// milliseconds are patched in on later calls. Not thread-safe; each user
+// keeps its own instance.
+class TimestampFormatter {
+public:
+    explicit TimestampFormatter(
+        TimestampFormat format = TimestampFormat::LocalTime
+    ) noexcept;
+
+    TimestampFormat format() const noexcept;
+    void set_format(TimestampFormat format) noexcept;
+
+    void append_to(std::string &out);
+    void append_to(std::string &out, std::chrono::system_clock::time_point now);
+
+private:
+    static constexpr std::size_t prefix_length = 19;
+
+    TimestampFormat format_;
+    std::time_t cached_second_;
+    char prefix_[prefix_length];
+};
+
+}  // namespace metrics
+
+#endif
@@ -0,0 +1,533 @@
+#include "binary_format.hpp"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+constexpr char header_frame = 'H';
+constexpr char template_frame = 'T';
+constexpr char record_frame = 'R';
+constexpr std::string_view magic = "metrics\x01";
+
+constexpr uint8_t no_window = 0xFF;
+
+uint64_t zigzag(int64_t value) noexcept {
+    return (static_cast<uint64_t>(value) << 1) ^
+           static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) noexcept {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void put_varint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool get_varint(std::string_view &in, uint64_t &value) noexcept {
+    value = 0;
+    for (int shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        const auto byte = static_cast<uint8_t>(in.front());
+        in.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void put_frame(std::string &out, char type, std::string_view payload) {
+    out += type;
+    put_varint(out, payload.size());
+    out.append(payload);
+}
+
+class BitWriter {
+public:
+    explicit BitWriter(std::string &out) noexcept : out_(out), used_(8) {
+    }
+
+    void write(uint64_t value, int bits) {
+        while (bits > 0) {
+            if (used_ == 8) {
+                out_ += '\0';
+                used_ = 0;
+            }
+            const int take = std::min(bits, 8 - used_);
+            const auto chunk = static_cast<uint8_t>(
+                (value >> (bits - take)) & ((1u << take) - 1)
+            );
+            out_.back() = static_cast<char>(
+                static_cast<uint8_t>(out_.back()) |
+                (chunk << (8 - used_ - take))
+            );
+            used_ += take;
+            bits -= take;
+        }
+    }
+
+    void write_varint(uint64_t value) {
+        while (value >= 0x80) {
+            write((value & 0x7F) | 0x80, 8);
+            value >>= 7;
+        }
+        write(value, 8);
+    }
+
+private:
+    std::string &out_;
+    int used_;
+};
+
+class BitReader {
+public:
+    explicit BitReader(std::string_view in) noexcept : in_(in), position_(0) {
+    }
+
+    bool read(uint64_t &value, int bits) noexcept {
+        if (position_ + static_cast<std::size_t>(bits) > in_.size() * 8) {
+            return false;
+        }
+        value = 0;
+        while (bits > 0) {
+            const auto byte = static_cast<uint8_t>(in_[position_ / 8]);
+            const int offset = static_cast<int>(position_ % 8);
+            const int take = std::min(bits, 8 - offset);
+            const uint64_t chunk =
+                (byte >> (8 - offset - take)) & ((1u << take) - 1);
+            value = (value << take) | chunk;
+            position_ += take;
+            bits -= take;
+        }
+        return true;
+    }
+
+    bool read_varint(uint64_t &value) noexcept {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint64_t byte;
+            if (!read(byte, 8)) {
+                return false;
+            }
+            value |= (byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::string_view in_;
+    std::size_t position_;
+};
+
+constexpr uint8_t integer_slot = 0;
+constexpr uint8_t unsigned_slot = 1;
+constexpr uint8_t double_slot = 2;
+constexpr uint8_t float_slot = 3;
+
+// Reads a value back from the characters append_number wrote for it. The
+// shortest round-trip form parses to the exact value that was written.
+bool parse_value(
+    std::string_view token,
+    metrics::NumberType type,
+    uint8_t &slot,
+    uint64_t &bits
+) {
+    const char *first = token.data();
+    const char *last = token.data() + token.size();
+    std::from_chars_result result{};
+    switch (type) {
+        case metrics::NumberType::Signed: {
+            int64_t value = 0;
+            result = std::from_chars(first, last, value);
+            slot = integer_slot;
+            bits = static_cast<uint64_t>(value);
+            break;
+        }
+        case metrics::NumberType::Unsigned:
+            result = std::from_chars(first, last, bits);
+            slot = unsigned_slot;
+            break;
+        case metrics::NumberType::Double: {
+            double value = 0;
+            result = std::from_chars(first, last, value);
+            slot = double_slot;
+            bits = std::bit_cast<uint64_t>(value);
+            break;
+        }
+        case metrics::NumberType::Float: {
+            float value = 0;
+            result = std::from_chars(first, last, value);
+            slot = float_slot;
+            bits = std::bit_cast<uint32_t>(value);
+            break;
+        }
+        default:
+            return false;
+    }
+    return result.ec == std::errc{} && result.ptr == last;
+}
+
+void format_number(std::string &out, uint8_t slot, uint64_t bits) {
+    char buffer[32];
+    std::to_chars_result result;
+    if (slot == integer_slot) {
+        result = std::to_chars(
+            buffer, buffer + sizeof(buffer), static_cast<int64_t>(bits)
+        );
+    } else if (slot == unsigned_slot) {
+        result = std::to_chars(buffer, buffer + sizeof(buffer), bits);
+    } else if (slot == double_slot) {
+        result = std::to_chars(
+            buffer, buffer + sizeof(buffer), std::bit_cast<double>(bits)
+        );
+    } else {
+        result = std::to_chars(
+            buffer, buffer + sizeof(buffer),
+            std::bit_cast<float>(static_cast<uint32_t>(bits))
+        );
+    }
+    out.append(buffer, result.ptr);
+}
+
+void encode_xor(
+    BitWriter &writer,
+    uint64_t previous,
+    uint64_t current,
+    uint8_t &leading,
+    uint8_t &trailing
+) {
+    const uint64_t x = previous ^ current;
+    if (x == 0) {
+        writer.write(0, 1);
+        return;
+    }
+    writer.write(1, 1);
+    const int lz = std::min(std::countl_zero(x), 31);
+    const int tz = std::countr_zero(x);
+    if (leading != no_window && lz >= leading && tz >= trailing) {
+        writer.write(0, 1);
+        writer.write(x >> trailing, 64 - leading - trailing);
+        return;
+    }
+    const int length = 64 - lz - tz;
+    writer.write(1, 1);
+    writer.write(static_cast<uint64_t>(lz), 5);
+    writer.write(static_cast<uint64_t>(length - 1), 6);
+    writer.write(x >> tz, length);
+    leading = static_cast<uint8_t>(lz);
+    trailing = static_cast<uint8_t>(tz);
+}
+
+bool decode_xor(
+    BitReader &reader,
+    uint64_t &value,
+    uint8_t &leading,
+    uint8_t &trailing
+) {
+    uint64_t bit;
+    if (!reader.read(bit, 1)) {
+        return false;
+    }
+    if (bit == 0) {
+        return true;
+    }
+    if (!reader.read(bit, 1)) {
+        return false;
+    }
+    uint64_t x;
+    if (bit == 0) {
+        if (leading == no_window ||
+            !reader.read(x, 64 - leading - trailing)) {
+            return false;
+        }
+        value ^= x << trailing;
+        return true;
+    }
+    uint64_t lz;
+    uint64_t length;
+    if (!reader.read(lz, 5) || !reader.read(length, 6)) {
+        return false;
+    }
+    length += 1;
+    if (lz + length > 64 || !reader.read(x, static_cast<int>(length))) {
+        return false;
+    }
+    leading = static_cast<uint8_t>(lz);
+    trailing = static_cast<uint8_t>(64 - lz - length);
+    value ^= x << trailing;
+    return true;
+}
+
+}  // namespace
+
+metrics::BinaryEncoder::BinaryEncoder() {
+    reset();
+}
+
+void metrics::BinaryEncoder::reset() noexcept {
+    header_written_ = false;
+    previous_timestamp_ = 0;
+    previous_delta_ = 0;
+    templates_.clear();
+}
+
+void metrics::BinaryEncoder::encode(
+    std::string &out,
+    std::chrono::system_clock::time_point timestamp,
+    std::string_view body,
+    std::span<const ValueLayout::Value> values
+) {
+    segments_.clear();
+    slots_.clear();
+    values_.clear();
+
+    std::size_t segment_start = 0;
+    for (const auto &value : values) {
+        uint8_t slot;
+        uint64_t bits;
+        if (value.begin < segment_start || value.end > body.size() ||
+            !parse_value(
+                body.substr(value.begin, value.end - value.begin), value.type,
+                slot, bits
+            )) {
+            continue;
+        }
+        segments_.push_back(
+            body.substr(segment_start, value.begin - segment_start)
+        );
+        slots_.push_back(static_cast<Slot>(slot));
+        values_.push_back(bits);
+        segment_start = value.end;
+    }
+    segments_.push_back(body.substr(segment_start));
+
+    key_.clear();
+    for (Slot slot : slots_) {
+        key_ += static_cast<char>('0' + static_cast<int>(slot));
+    }
+    for (std::string_view segment : segments_) {
+        key_ += '\0';
+        key_.append(segment);
+    }
+
+    if (templates_.size() >= max_templates && !templates_.contains(key_)) {
+        reset();
+    }
+    if (!header_written_) {
+        put_frame(out, header_frame, magic);
+        header_written_ = true;
+    }
+
+    auto [it, inserted] = templates_.try_emplace(key_);
+    Template &shape = it->second;
+    if (inserted) {
+        shape.id = templates_.size() - 1;
+        shape.values.assign(slots_.size(), 0);
+        shape.leading.assign(slots_.size(), no_window);
+        shape.trailing.assign(slots_.size(), 0);
+
+        payload_.clear();
+        put_varint(payload_, shape.id);
+        put_varint(payload_, slots_.size());
+        for (Slot slot : slots_) {
+            payload_ += static_cast<char>(slot);
+        }
+        for (std::string_view segment : segments_) {
+            put_varint(payload_, segment.size());
+            payload_.append(segment);
+        }
+        put_frame(out, template_frame, payload_);
+    }
+
+    const int64_t nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            timestamp.time_since_epoch()
+        )
+            .count();
+    const int64_t delta = nanos - previous_timestamp_;
+
+    payload_.clear();
+    BitWriter writer(payload_);
+    writer.write_varint(zigzag(delta - previous_delta_));
+    writer.write_varint(shape.id);
+    for (std::size_t i = 0; i < slots_.size(); ++i) {
+        if (slots_[i] == Slot::Double || slots_[i] == Slot::Float) {
+            encode_xor(
+                writer, shape.values[i], values_[i], shape.leading[i],
+                shape.trailing[i]
+            );
+        } else {
+            writer.write_varint(
+                zigzag(static_cast<int64_t>(values_[i] - shape.values[i]))
+            );
+        }
+        shape.values[i] = values_[i];
+    }
+    put_frame(out, record_frame, payload_);
+
+    previous_timestamp_ = nanos;
+    previous_delta_ = delta;
+}
+
+metrics::BinaryDecoder::BinaryDecoder(TimestampFormat format) noexcept
+    : timestamp_(format),
+      failed_(false),
+      started_(false),
+      previous_timestamp_(0),
+      previous_delta_(0) {
+}
+
+bool metrics::BinaryDecoder::idle() const noexcept {
+    return pending_.empty();
+}
+
+bool metrics::BinaryDecoder::decode(std::string_view bytes, std::string &out) {
+    if (failed_) {
+        return false;
+    }
+    pending_.append(bytes);
+
+    std::string_view in = pending_;
+    while (!in.empty()) {
+        const auto type = static_cast<uint8_t>(in.front());
+        std::string_view frame = in.substr(1);
+        uint64_t length;
+        if (!get_varint(frame, length)) {
+            // A length varint never needs more than ten bytes.
+            failed_ = in.size() > 10;
+            break;
+        }
+        if (frame.size() < length) {
+            break;
+        }
+        if (!decode_frame(type, frame.substr(0, length), out)) {
+            failed_ = true;
+            break;
+        }
+        frame.remove_prefix(length);
+        in = frame;
+    }
+    pending_.erase(0, pending_.size() - in.size());
+    return !failed_;
+}
+
+bool metrics::BinaryDecoder::decode_frame(
+    uint8_t type,
+    std::string_view payload,
+    std::string &out
+) {
+    switch (type) {
+        case header_frame:
+            if (payload != magic) {
+                return false;
+            }
+            templates_.clear();
+            previous_timestamp_ = 0;
+            previous_delta_ = 0;
+            started_ = true;
+            return true;
+        case template_frame:
+            return !started_ || decode_template(payload);
+        case record_frame:
+            return !started_ || decode_record(payload, out);
+        default:
+            return false;
+    }
+}
+
+bool metrics::BinaryDecoder::decode_template(std::string_view payload) {
+    uint64_t id;
+    uint64_t slots;
+    if (!get_varint(payload, id) || !get_varint(payload, slots) ||
+        payload.size() < slots) {
+        return false;
+    }
+    Template shape;
+    shape.slots.assign(payload.begin(), payload.begin() + slots);
+    payload.remove_prefix(slots);
+    for (uint64_t i = 0; i <= slots; ++i) {
+        uint64_t length;
+        if (!get_varint(payload, length) || payload.size() < length) {
+            return false;
+        }
+        shape.segments.emplace_back(payload.substr(0, length));
+        payload.remove_prefix(length);
+    }
+    for (uint8_t slot : shape.slots) {
+        if (slot > float_slot) {
+            return false;
+        }
+    }
+    shape.values.assign(slots, 0);
+    shape.leading.assign(slots, no_window);
+    shape.trailing.assign(slots, 0);
+    templates_[id] = std::move(shape);
+    return true;
+}
+
+bool metrics::BinaryDecoder::decode_record(
+    std::string_view payload,
+    std::string &out
+) {
+    BitReader reader(payload);
+    uint64_t delta_of_delta;
+    uint64_t id;
+    if (!reader.read_varint(delta_of_delta) || !reader.read_varint(id)) {
+        return false;
+    }
+    auto it = templates_.find(id);
+    if (it == templates_.end()) {
+        return false;
+    }
+    Template &shape = it->second;
+    for (std::size_t i = 0; i < shape.slots.size(); ++i) {
+        if (shape.slots[i] >= double_slot) {
+            if (!decode_xor(
+                    reader, shape.values[i], shape.leading[i],
+                    shape.trailing[i]
+                )) {
+                return false;
+            }
+        } else {
+            uint64_t delta;
+            if (!reader.read_varint(delta)) {
+                return false;
+            }
+            shape.values[i] += static_cast<uint64_t>(unzigzag(delta));
+        }
+    }
+
+    previous_delta_ += unzigzag(delta_of_delta);
+    previous_timestamp_ += previous_delta_;
+    using std::chrono::system_clock;
+    timestamp_.append_to(
+        out, system_clock::time_point(
+                 std::chrono::duration_cast<system_clock::duration>(
+                     std::chrono::nanoseconds(previous_timestamp_)
+                 )
+             )
+    );
+    for (std::size_t i = 0; i < shape.slots.size(); ++i) {
+        out += shape.segments[i];
+        format_number(out, shape.slots[i], shape.values[i]);
+    }
+    out += shape.segments.back();
+    out += '\n';
+    return true;
+}
@@ -1,115 +1,950 @@
 #include "collector.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
-#include <fstream>
-#include <iomanip>
+#include <filesystem>
+#include <iterator>
 #include <memory>
 #include <mutex>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <thread>
+#include <tuple>
 #include <vector>
+#include "compression.hpp"
+#include "io_uring.hpp"
 #include "metric.hpp"
+#include "openmetrics.hpp"
 
-metrics::MetricsCollector::MetricsCollector() {
+namespace {
+
+void write_all(int fd, std::string_view data) noexcept {
+    while (!data.empty()) {
+        const ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+}
+
+constexpr std::size_t stamp_size = 15;
+
+// YYYYMMDDTHHMMSS, optionally followed by -N.
+bool is_segment_stamp(std::string_view stamp) noexcept {
+    const auto digits = [](std::string_view s) {
+        return !s.empty() && std::all_of(s.begin(), s.end(), [](char c) {
+                   return c >= '0' && c <= '9';
+               });
+    };
+    if (stamp.size() < stamp_size || stamp[8] != 'T' ||
+        !digits(stamp.substr(0, 8)) || !digits(stamp.substr(9, 6))) {
+        return false;
+    }
+    return stamp.size() == stamp_size ||
+           (stamp[stamp_size] == '-' && digits(stamp.substr(stamp_size + 1)));
+}
+
+// Deletes the oldest segments of filename beyond options.max_segments.
+void prune_segments(
+    const std::string &filename,
+    const metrics::FileOptions &options
+) {
+    namespace fs = std::filesystem;
+    const fs::path path(filename);
+    const std::string prefix = path.filename().string() + '.';
+    const auto extension = metrics::compression_extension(options.compression);
+    const fs::path directory =
+        path.has_parent_path() ? path.parent_path() : fs::path(".");
+
+    // Sorted by time, then by the -N suffix of segments rotated within
+    // the same second.
+    std::vector<std::tuple<std::string, uint64_t, std::string>> segments;
+    std::error_code error;
+    for (fs::directory_iterator it(directory, error), end;
+         !error && it != end; it.increment(error)) {
+        std::string name = it->path().filename().string();
+        if (name.size() <= prefix.size() + extension.size() ||
+            !name.starts_with(prefix) || !name.ends_with(extension)) {
+            continue;
+        }
+        auto stamp = std::string_view(name).substr(prefix.size());
+        stamp.remove_suffix(extension.size());
+        if (!is_segment_stamp(stamp)) {
+            continue;
+        }
+        const uint64_t n =
+            stamp.size() > stamp_size
+                ? std::strtoull(stamp.data() + stamp_size + 1, nullptr, 10)
+                : 0;
+        segments.emplace_back(
+            std::string(stamp.substr(0, stamp_size)), n, std::move(name)
+        );
+    }
+    if (segments.size() <= options.max_segments) {
+        return;
+    }
+    std::sort(segments.begin(), segments.end());
+    const std::size_t excess = segments.size() - options.max_segments;
+    for (std::size_t i = 0; i < excess; ++i) {
+        fs::remove(directory / std::get<2>(segments[i]), error);
+    }
+}
+
+// Longest std::to_chars output of a column type, -1.7976931348623157e+308.
+constexpr std::size_t max_number_chars = 24;
+
+// Flushes one ScalarColumn with the same per-metric steps as
+// collect_and_reset. The first loop takes the values, walking the pointer
+// arrays in order and skipping the atomic exchange for values that are
+// already zero; the second formats them into space reserved up front, so
+// it copies labels and converts numbers without checking capacity.
+template <typename N>
+void append_column(
+    std::string &out,
+    metrics::ScalarColumn<N> &column,
+    bool keyframe
+) {
+    auto &taken = column.taken;
+    auto &values = column.taken_values;
+    taken.clear();
+    values.clear();
+    std::size_t bound = 0;
+    for (std::size_t i = 0; i < column.size(); ++i) {
+        metrics::ChangeFlag &changed = *column.changed[i];
+        if (!changed.consume() && !keyframe) {
+            continue;
+        }
+        auto &slot = *column.values[i];
+        N value = slot.load(std::memory_order_relaxed);
+        if (value != N{}) {
+            value = slot.exchange(N{}, std::memory_order_relaxed);
+            changed.mark();
+        }
+        taken.push_back(i);
+        values.push_back(value);
+        const std::size_t begin = i == 0 ? 0 : column.label_ends[i - 1];
+        bound += column.label_ends[i] - begin + max_number_chars;
+    }
+
+    metrics::ValueLayout *layout = metrics::value_layout_for(out);
+    const std::size_t used = out.size();
+    out.resize(used + bound);
+    char *const start = out.data();
+    char *at = start + used;
+    char *const end = start + out.size();
+    for (std::size_t k = 0; k < taken.size(); ++k) {
+        const std::size_t i = taken[k];
+        const std::size_t begin = i == 0 ? 0 : column.label_ends[i - 1];
+        const std::size_t length = column.label_ends[i] - begin;
+        std::memcpy(at, column.labels.data() + begin, length);
+        char *const number = at + length;
+        at = std::to_chars(number, end, values[k]).ptr;
+        if (layout != nullptr) [[unlikely]] {
+            layout->values.push_back(
+                {static_cast<std::size_t>(number - start),
+                 static_cast<std::size_t>(at - start),
+                 metrics::number_type<N>()}
+            );
+        }
+    }
+    out.resize(static_cast<std::size_t>(at - out.data()));
+}
+
+}  // namespace
+
+metrics::MetricsCollector::MetricsCollector(WriterOptions writer)
+    : keyframe_interval_(0),
+      flushes_since_keyframe_(0),
+      keyframe_generation_(0),
+      self_metrics_(nullptr),
+      use_uring_(false),
+      sync_data_(writer.sync_data),
+      queue_policy_(writer.policy),
+      max_overflow_bytes_(writer.max_overflow_bytes),
+      writer_queue_(writer.capacity),
+      stopped_(false),
+      writer_sleeping_(false),
+      writer_wakeups_(0),
+      writer_pops_(0),
+      blocked_producers_(0),
+      dropped_(0),
+      merged_(0),
+      overflow_bytes_(0),
+      overflow_size_(0),
+      reopen_requested_(false),
+      file_generation_(0),
+      finaliser_stopped_(false),
+      next_sink_id_(0),
+      scheduler_stopped_(false),
+      expositions_(0) {
+    if (writer.backend != WriterBackend::Sync) {
+        try {
+            uring_ = std::make_unique<IoUring>(uring_entries);
+            use_uring_.store(true);
+        } catch (const std::system_error &) {
+            if (writer.backend == WriterBackend::IoUring) {
+                throw;
+            }
+        }
+    }
     writer_ = std::thread(&MetricsCollector::write_from_queue, this);
 }
 
 metrics::MetricsCollector::~MetricsCollector() {
     {
-        std::unique_lock lock(mutex_);
-        stopped_ = true;
+        std::unique_lock lock(scheduler_mutex_);
+        scheduler_stopped_ = true;
     }
-    cv_.notify_one();
+    scheduler_cv_.notify_one();
+    if (scheduler_.joinable()) {
+        scheduler_.join();
+    }
+
+    stopped_.store(true);
+    writer_wakeups_.fetch_add(1);
+    writer_wakeups_.notify_one();
     if (writer_.joinable()) {
         writer_.join();
     }
+    close_files();
+
+    {
+        std::unique_lock lock(finaliser_mutex_);
+        finaliser_stopped_ = true;
+    }
+    finaliser_cv_.notify_one();
+    if (finaliser_.joinable()) {
+        finaliser_.join();
+    }
+}
+
+metrics::WriterBackend metrics::MetricsCollector::writer_backend(
+) const noexcept {
+    return use_uring_.load() ? WriterBackend::IoUring : WriterBackend::Sync;
+}
+
+void metrics::MetricsCollector::set_file_options(
+    const std::string &filename,
+    FileOptions options
+) {
+    // Fails here rather than on the writer thread.
+    make_compressor(options.compression);
+    const bool rotated = options.max_size > 0 || options.max_age.count() > 0;
+    {
+        std::unique_lock sinks_lock(scheduler_mutex_);
+        if (rotated && writes_binary(filename)) {
+            throw std::invalid_argument("binary files cannot be rotated");
+        }
+        std::unique_lock lock(file_options_mutex_);
+        file_options_[filename] = options;
+    }
+    reopen_files();
+}
+
+void metrics::MetricsCollector::reopen_files() noexcept {
+    file_generation_.fetch_add(1, std::memory_order_acq_rel);
+    reopen_requested_.store(true, std::memory_order_release);
 }
 
 void metrics::MetricsCollector::register_metric(std::shared_ptr<Metric> metric
 ) {
     std::unique_lock lock(mutex_);
-    metrics_.push_back(metric);
+    metrics_.add(std::move(metric));
+}
+
+void metrics::MetricsCollector::register_weak_metric(
+    const std::shared_ptr<Metric> &metric
+) {
+    std::unique_lock lock(mutex_);
+    metrics_.add_weak(metric);
+}
+
+bool metrics::MetricsCollector::unregister_metric(std::string_view name) {
+    std::unique_lock lock(mutex_);
+    return metrics_.remove(name);
+}
+
+std::shared_ptr<metrics::Metric>
+metrics::MetricsCollector::find_metric(std::string_view name) const {
+    std::unique_lock lock(mutex_);
+    return metrics_.find(name);
+}
+
+const metrics::CollectorMetrics &
+metrics::MetricsCollector::register_self_metrics(const std::string &prefix) {
+    std::unique_lock lock(mutex_);
+    if (self_metrics_owner_) {
+        return *self_metrics_owner_;
+    }
+    // 1us to about 4s.
+    const auto buckets = exponential_buckets(1e-6, 4, 12);
+    auto self = std::make_unique<CollectorMetrics>();
+    self->queue_depth =
+        std::make_shared<Gauge<int64_t>>(prefix + "_queue_depth");
+    self->flush_duration = std::make_shared<Histogram>(
+        prefix + "_flush_duration_seconds", buckets
+    );
+    self->write_duration = std::make_shared<Histogram>(
+        prefix + "_write_duration_seconds", buckets
+    );
+    self->write_errors =
+        std::make_shared<Counter<>>(prefix + "_write_errors_total");
+    self->dropped = std::make_shared<Counter<>>(prefix + "_dropped_total");
+    self->bytes_written = std::make_shared<Family<Counter<>>>(
+        prefix + "_bytes_written_total", std::vector<std::string>{"file"}
+    );
+    const std::shared_ptr<Metric> owned[] = {
+        self->queue_depth, self->flush_duration, self->write_duration,
+        self->write_errors, self->dropped,        self->bytes_written
+    };
+    std::size_t added = 0;
+    try {
+        for (const auto &metric : owned) {
+            metrics_.add(metric);
+            ++added;
+        }
+    } catch (...) {
+        for (std::size_t i = 0; i < added; ++i) {
+            metrics_.remove(owned[i]->name());
+        }
+        throw;
+    }
+    self_metrics_.store(self.get(), std::memory_order_release);
+    self_metrics_owner_ = std::move(self);
+    return *self_metrics_owner_;
 }
 
 void metrics::MetricsCollector::flush(std::string filename) {
-    std::vector<std::pair<std::string, std::string>> metrics_snapshot;
-    metrics_snapshot.reserve(metrics_.size());
+    if (expositions_.load(std::memory_order_acquire) > 0) {
+        throw std::logic_error("an exposed collector cannot be flushed");
+    }
+    std::string buffer = take_buffer();
+    const auto started = std::chrono::steady_clock::now();
     {
         std::unique_lock lock(mutex_);
-        for (auto &metric : metrics_) {
-            metrics_snapshot.emplace_back(
-                metric->name(), metric->value_as_str()
-            );
-            metric->reset();
-        }
+        timestamp_.append_to(buffer);
+        append_metrics(buffer);
+    }
+    observe_flush(started);
+    buffer += '\n';
+    enqueue(std::move(filename), std::move(buffer));
+}
+
+void metrics::MetricsCollector::observe_flush(
+    std::chrono::steady_clock::time_point started
+) {
+    auto *self = self_metrics_.load(std::memory_order_acquire);
+    if (self) {
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - started;
+        self->flush_duration->observe(elapsed.count());
+    }
+}
+
+// Expects mutex_ to be held.
+void metrics::MetricsCollector::sample_queue_depth() const {
+    auto *self = self_metrics_.load(std::memory_order_acquire);
+    if (self) {
+        const std::size_t depth =
+            writer_queue_.size() + overflow_size_.load();
+        self->queue_depth->set(static_cast<int64_t>(depth));
+    }
+}
+
+void metrics::MetricsCollector::render_openmetrics(std::string &out) const {
+    std::unique_lock lock(mutex_);
+    sample_queue_depth();
+    metrics_.for_each([&](const Metric &metric) {
+        append_openmetrics(out, metric);
+    });
+    out += "# EOF\n";
+}
+
+std::string metrics::MetricsCollector::take_buffer() {
+    std::unique_lock lock(spare_mutex_);
+    if (spare_buffers_.empty()) {
+        return {};
     }
+    std::string buffer = std::move(spare_buffers_.back());
+    spare_buffers_.pop_back();
+    return buffer;
+}
 
-    size_t approx_length = 256;
-    for (const auto &[name, value] : metrics_snapshot) {
-        approx_length += name.size() + value.size() + 32;
+// Expects mutex_ to be held.
+void metrics::MetricsCollector::append_metrics(std::string &buffer) {
+    bool keyframe = true;
+    if (keyframe_interval_ > 0) {
+        const uint64_t generation =
+            file_generation_.load(std::memory_order_acquire);
+        if (generation != keyframe_generation_) {
+            keyframe_generation_ = generation;
+            flushes_since_keyframe_ = 0;
+        }
+        keyframe = flushes_since_keyframe_ == 0;
+        flushes_since_keyframe_ =
+            (flushes_since_keyframe_ + 1) % keyframe_interval_;
     }
+    sample_queue_depth();
 
-    std::string buffer;
-    buffer.reserve(approx_length);
-    buffer += current_timestamp();
-    for (auto &[name, value] : metrics_snapshot) {
+    // Plain counters and gauges go first, grouped by value type; the rest
+    // follow in registration order.
+    auto &columns = metrics_.scalar_columns();
+    append_column(buffer, columns.unsigned_values, keyframe);
+    append_column(buffer, columns.signed_values, keyframe);
+    append_column(buffer, columns.double_values, keyframe);
+    metrics_.for_each_other([&](Metric &metric) {
+        // Marks are consumed on keyframes too, so the next delta is relative
+        // to what was just written. Skipped metrics are not reset: their
+        // value is unchanged since the last reset anyway.
+        const bool changed = metric.consume_changed();
+        if (!changed && !keyframe) {
+            return;
+        }
         buffer += " \"";
-        buffer += name;
+        buffer += metric.name();
         buffer += "\" ";
-        buffer += value;
+        metric.collect_and_reset(buffer);
+    });
+}
+
+void metrics::MetricsCollector::enqueue(
+    std::string filename,
+    std::string buffer
+) {
+    Task task{std::move(filename), std::move(buffer)};
+    if (queue_policy_ == QueuePolicy::Merge &&
+        overflow_size_.load(std::memory_order_acquire) > 0) {
+        // Lines for a file with an overflow task must follow it.
+        push_or_merge(task);
+    } else if (!writer_queue_.try_push(task)) {
+        switch (queue_policy_) {
+            case QueuePolicy::Block:
+                push_blocking(task);
+                break;
+            case QueuePolicy::DropOldest:
+                push_dropping_oldest(task);
+                break;
+            case QueuePolicy::DropNewest:
+                count_dropped();
+                return;
+            case QueuePolicy::Merge:
+                push_or_merge(task);
+                break;
+        }
     }
-    buffer += '\n';
+    wake_writer();
+}
 
-    {
-        std::unique_lock lock(mutex_);
-        writer_queue_.emplace(std::move(filename), std::move(buffer));
+void metrics::MetricsCollector::wake_writer() {
+    // Pairs with the fence in write_from_queue: either the writer sees the
+    // new task before sleeping or this thread sees that it sleeps.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_sleeping_.load(std::memory_order_relaxed) &&
+        writer_sleeping_.exchange(false)) {
+        writer_wakeups_.fetch_add(1);
+        writer_wakeups_.notify_one();
+    }
+}
+
+void metrics::MetricsCollector::push_blocking(Task &task) {
+    blocked_producers_.fetch_add(1);
+    while (true) {
+        const uint32_t pops = writer_pops_.load();
+        if (writer_queue_.try_push(task)) {
+            break;
+        }
+        wake_writer();
+        writer_pops_.wait(pops);
+    }
+    blocked_producers_.fetch_sub(1);
+}
+
+void metrics::MetricsCollector::push_dropping_oldest(Task &task) {
+    Task oldest;
+    while (!writer_queue_.try_push(task)) {
+        if (writer_queue_.try_pop(oldest)) {
+            count_dropped();
+        } else {
+            // The oldest slot is claimed by a producer that has not filled
+            // it yet; neither call can succeed until that producer runs.
+            std::this_thread::yield();
+        }
+    }
+}
+
+void metrics::MetricsCollector::push_or_merge(Task &task) {
+    std::unique_lock lock(overflow_mutex_);
+    auto it = std::find_if(overflow_.begin(), overflow_.end(), [&](auto &t) {
+        return t.filename == task.filename;
+    });
+    if (it == overflow_.end() && writer_queue_.try_push(task)) {
+        return;
     }
-    cv_.notify_one();
+    if (overflow_bytes_ + task.output.size() > max_overflow_bytes_) {
+        lock.unlock();
+        count_dropped();
+        return;
+    }
+    overflow_bytes_ += task.output.size();
+    if (it != overflow_.end()) {
+        it->output += task.output;
+    } else {
+        overflow_.push_back(std::move(task));
+        overflow_size_.store(overflow_.size(), std::memory_order_release);
+    }
+    merged_.fetch_add(1, std::memory_order_relaxed);
 }
 
-std::string metrics::MetricsCollector::current_timestamp() {
-    using namespace std::chrono;
-    auto now = system_clock::now();
-    auto now_time_t = system_clock::to_time_t(now);
-    auto now_ms = duration_cast<milliseconds>(now.time_since_epoch()) % 1000;
+void metrics::MetricsCollector::count_dropped() {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    if (auto *self = self_metrics_.load(std::memory_order_acquire)) {
+        self->dropped->inc();
+    }
+}
 
-    std::tm now_tm;
-#ifdef _WIN32
-    localtime_s(&now_tm, &now_time_t);
-#else
-    localtime_r(&now_time_t, &now_tm);
-#endif
+metrics::WriterQueueStats metrics::MetricsCollector::writer_queue_stats(
+) const noexcept {
+    return {
+        writer_queue_.capacity(), writer_queue_.size(),
+        dropped_.load(std::memory_order_relaxed),
+        merged_.load(std::memory_order_relaxed)
+    };
+}
+
+void metrics::MetricsCollector::set_timestamp_format(TimestampFormat format) {
+    std::unique_lock lock(mutex_);
+    timestamp_.set_format(format);
+}
 
-    std::ostringstream oss;
-    oss << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S") << "."
-        << std::setfill('0') << std::setw(3) << now_ms.count();
-    return std::move(oss).str();
+void metrics::MetricsCollector::set_delta_flush(std::size_t keyframe_interval
+) {
+    std::unique_lock lock(mutex_);
+    keyframe_interval_ = keyframe_interval;
+    flushes_since_keyframe_ = 0;
+    keyframe_generation_ = file_generation_.load(std::memory_order_acquire);
 }
 
 void metrics::MetricsCollector::write_from_queue() {
-    while(!stopped_) {
-        std::string filename;
-        std::string buffer;
+    std::vector<Task> batch;
+    while (true) {
         {
-            std::unique_lock lock(file_mutex_);
-            cv_.wait(lock, [this] {
-                return !writer_queue_.empty() || stopped_;
-            });
+            std::unique_lock lock(spare_mutex_);
+            // Return the buffers of the previous batch so flush() can format
+            // into memory that is already allocated.
+            for (auto &task : batch) {
+                if (spare_buffers_.size() >= max_spare_buffers) {
+                    break;
+                }
+                task.output.clear();
+                spare_buffers_.push_back(std::move(task.output));
+            }
+        }
+        batch.clear();
+
+        if (!take_batch(batch)) {
+            const auto idle = [this] {
+                return writer_queue_.empty() &&
+                       overflow_size_.load(std::memory_order_acquire) == 0;
+            };
+            if (stopped_.load() && idle()) {
+                return;
+            }
+            const uint32_t wakeups = writer_wakeups_.load();
+            writer_sleeping_.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!idle()) {
+                // A producer has claimed a slot but not filled it yet.
+                std::this_thread::yield();
+            } else if (!stopped_.load()) {
+                writer_wakeups_.wait(wakeups);
+            }
+            writer_sleeping_.store(false);
+            continue;
+        }
+
+        if (reopen_requested_.exchange(false, std::memory_order_acq_rel)) {
+            close_files();
+        }
+        write_batch(batch);
+    }
+}
+
+// Takes up to one queue's worth of tasks, then the overflow, which is newer
+// than anything queued for the same file.
+bool metrics::MetricsCollector::take_batch(std::vector<Task> &batch) {
+    Task task;
+    for (std::size_t i = 0; i < writer_queue_.capacity(); ++i) {
+        if (!writer_queue_.try_pop(task)) {
+            break;
+        }
+        batch.push_back(std::move(task));
+    }
+    if (overflow_size_.load(std::memory_order_acquire) > 0) {
+        std::unique_lock lock(overflow_mutex_);
+        for (auto &pending : overflow_) {
+            batch.push_back(std::move(pending));
+        }
+        overflow_.clear();
+        overflow_bytes_ = 0;
+        overflow_size_.store(0, std::memory_order_release);
+    }
+    if (batch.empty()) {
+        return false;
+    }
+    writer_pops_.fetch_add(1);
+    if (blocked_producers_.load() > 0) {
+        writer_pops_.notify_all();
+    }
+    return true;
+}
+
+void metrics::MetricsCollector::write_batch(std::vector<Task> &tasks) {
+    // Buffers headed to the same file are written in the order they were
+    // queued, with as few system calls as the backend allows.
+    std::vector<FileWrite> files;
+    for (auto &task : tasks) {
+        if (task.output.empty()) {
+            continue;
+        }
+        auto it = std::find_if(files.begin(), files.end(), [&](auto &f) {
+            return *f.filename == task.filename;
+        });
+        if (it == files.end()) {
+            it = files.insert(files.end(), FileWrite{});
+            it->filename = &task.filename;
+        }
+        it->iov.push_back({task.output.data(), task.output.size()});
+        it->size += task.output.size();
+    }
+
+    const bool uring = use_uring_.load(std::memory_order_relaxed);
+    if (uring) {
+        const auto started = std::chrono::steady_clock::now();
+        for (auto &file : files) {
+            file.started = started;
+            prepare_write(file);
+        }
+        submit_writes(files);
+    }
+    for (auto &file : files) {
+        if (!uring) {
+            file.started = std::chrono::steady_clock::now();
+            prepare_write(file);
+        }
+        // Finishes short writes and files that did not fit in the ring.
+        if (file.fd >= 0 && file.error == 0) {
+            write_file(file);
+        }
+        finish_write(file);
+    }
+}
 
-            if (!writer_queue_.empty()) {
-                filename = std::move(writer_queue_.front().filename);
-                buffer = std::move(writer_queue_.front().output);
-                writer_queue_.pop();
+void metrics::MetricsCollector::submit_writes(std::vector<FileWrite> &files) {
+    // The low bit of user_data marks the sync, the rest is the file index.
+    std::vector<IoCompletion> completions;
+    try {
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            auto &file = files[i];
+            if (file.fd < 0) {
+                continue;
+            }
+            const std::size_t needed =
+                (file.iov.size() + IOV_MAX - 1) / IOV_MAX + sync_data_;
+            // A chain must not be split across submissions.
+            if (uring_->free_entries() < needed) {
+                uring_->submit(completions);
+                if (uring_->free_entries() < needed) {
+                    continue;
+                }
+            }
+            for (std::size_t first = 0; first < file.iov.size();
+                 first += IOV_MAX) {
+                const auto count = static_cast<unsigned>(
+                    std::min<std::size_t>(file.iov.size() - first, IOV_MAX)
+                );
+                const bool last = first + count == file.iov.size();
+                uring_->writev(
+                    file.fd, file.iov.data() + first, count, i << 1,
+                    !last || sync_data_
+                );
+            }
+            if (sync_data_) {
+                uring_->fdatasync(file.fd, (i << 1) | 1, false);
             }
         }
+        uring_->submit(completions);
+    } catch (const std::system_error &) {
+        // The ring is unusable. Writes the kernel has accepted still point
+        // into this batch's buffers, so wait for them before dropping the
+        // ring; write_batch then finishes every file with writev from what
+        // completed, and later batches are written synchronously.
+        uring_->abandon(completions);
+        uring_.reset();
+        use_uring_.store(false);
+    }
 
-        if (!buffer.empty()) {
-            FILE* file = fopen(filename.c_str(), "a");
-            if (!file) {
+    for (const auto &completion : completions) {
+        auto &file = files[completion.user_data >> 1];
+        if (completion.result == -ECANCELED) {
+            continue;
+        }
+        if (completion.result < 0) {
+            file.error = -completion.result;
+        } else if (completion.user_data & 1) {
+            file.synced = true;
+        } else {
+            file.written += static_cast<uint64_t>(completion.result);
+        }
+    }
+}
+
+// Writes whatever is left of the file's share after file.written bytes.
+void metrics::MetricsCollector::write_file(FileWrite &file) {
+    auto &iov = file.iov;
+    std::size_t first = 0;
+    const auto skip = [&](uint64_t bytes) {
+        while (first < iov.size() && bytes >= iov[first].iov_len) {
+            bytes -= iov[first].iov_len;
+            ++first;
+        }
+        if (bytes > 0) {
+            auto *base = static_cast<char *>(iov[first].iov_base);
+            iov[first].iov_base = base + bytes;
+            iov[first].iov_len -= bytes;
+        }
+    };
+
+    skip(file.written);
+    while (first < iov.size()) {
+        const auto count = static_cast<int>(
+            std::min<std::size_t>(iov.size() - first, IOV_MAX)
+        );
+        ssize_t written = ::writev(file.fd, iov.data() + first, count);
+        if (written < 0) {
+            if (errno == EINTR) {
                 continue;
             }
-            fwrite(buffer.data(), 1, buffer.size(), file);
-            fclose(file);
+            file.error = errno;
+            return;
+        }
+        file.written += static_cast<uint64_t>(written);
+        skip(static_cast<uint64_t>(written));
+    }
+    if (sync_data_ && !file.synced) {
+        if (::fdatasync(file.fd) != 0) {
+            file.error = errno;
+            return;
+        }
+        file.synced = true;
+    }
+}
+
+void metrics::MetricsCollector::finish_write(FileWrite &file) {
+    auto *self = self_metrics_.load(std::memory_order_acquire);
+    if (file.fd >= 0 && file.error != 0) {
+        // A compressed stream now ends in a partial frame. It is dropped
+        // without a trailer, and open_file moves the file out as a segment
+        // of its own before writing a new stream.
+        ::close(file.fd);
+        files_.erase(*file.filename);
+    } else if (file.open) {
+        file.open->size += file.written;
+    }
+    if (!self) {
+        return;
+    }
+    if (file.fd < 0 || file.error != 0) {
+        self->write_errors->inc();
+        if (file.fd < 0) {
+            return;
+        }
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - file.started;
+    self->write_duration->observe(elapsed.count());
+    auto &bytes = file_bytes_[*file.filename];
+    if (!bytes) {
+        bytes = self->bytes_written->with_labels({*file.filename});
+    }
+    bytes->inc_by(file.written);
+}
+
+// Opens the file or rotates it first if due, and compresses the batch.
+void metrics::MetricsCollector::prepare_write(FileWrite &file) {
+    file.open = open_file(*file.filename);
+    if (!file.open) {
+        return;
+    }
+    file.fd = file.open->fd;
+    if (file.open->compressor) {
+        for (const auto &piece : file.iov) {
+            file.open->compressor->compress(
+                {static_cast<const char *>(piece.iov_base), piece.iov_len},
+                file.compressed
+            );
+        }
+        file.open->compressor->flush(file.compressed);
+        file.iov.assign(1, {file.compressed.data(), file.compressed.size()});
+        file.size = file.compressed.size();
+    }
+}
+
+metrics::MetricsCollector::OpenFile *
+metrics::MetricsCollector::open_file(const std::string &filename) {
+    const auto rotation_due = [](const OpenFile &file) {
+        const auto &options = file.options;
+        return (options.max_size > 0 && file.size >= options.max_size) ||
+               (options.max_age.count() > 0 &&
+                std::chrono::steady_clock::now() - file.opened >=
+                    options.max_age);
+    };
+
+    auto it = files_.find(filename);
+    if (it != files_.end()) {
+        if (!rotation_due(it->second)) {
+            return &it->second;
+        }
+        rotate_file(it);
+    }
+
+    OpenFile file;
+    {
+        std::unique_lock lock(file_options_mutex_);
+        auto options = file_options_.find(filename);
+        if (options != file_options_.end()) {
+            file.options = options->second;
+        }
+    }
+    file.path = filename;
+    file.path += compression_extension(file.options.compression);
+    file.fd = ::open(
+        file.path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644
+    );
+    if (file.fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    if (::fstat(file.fd, &info) == 0) {
+        file.size = static_cast<uint64_t>(info.st_size);
+    }
+    file.opened = std::chrono::steady_clock::now();
+    // A compressed file that already has data was left by an earlier run
+    // or by a failed write, and may end in a truncated frame that would
+    // make a stream appended after it undecodable. It becomes a segment
+    // as it is, without a trailer, and the stream starts in a new file.
+    const bool stale =
+        file.options.compression != Compression::None && file.size > 0;
+    if (!stale) {
+        file.compressor = make_compressor(file.options.compression);
+    }
+    it = files_.emplace(filename, std::move(file)).first;
+
+    // An existing file may already be over the limit.
+    if (stale || (it->second.options.max_size > 0 &&
+                  it->second.size >= it->second.options.max_size)) {
+        rotate_file(it);
+        return open_file(filename);
+    }
+    return &it->second;
+}
+
+// Renames the segment out of the way so the next write opens a new one,
+// and leaves ending its stream and closing it to the finaliser thread.
+void metrics::MetricsCollector::rotate_file(
+    std::unordered_map<std::string, OpenFile>::iterator it
+) {
+    OpenFile &file = it->second;
+    FinishedSegment segment{file.fd, {}, it->first, file.options};
+    if (file.compressor) {
+        file.compressor->finish(segment.trailer);
+    }
+
+    char stamp[32];
+    const std::time_t now = std::time(nullptr);
+    std::tm utc;
+    ::gmtime_r(&now, &utc);
+    std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &utc);
+    const auto extension = compression_extension(file.options.compression);
+    auto &[last_stamp, n] = last_segments_[it->first];
+    n = last_stamp == stamp ? n + 1 : 0;
+    last_stamp = stamp;
+    std::string target;
+    do {
+        target = it->first + '.' + stamp;
+        if (n > 0) {
+            target += '-' + std::to_string(n);
+        }
+        target += extension;
+    } while (::access(target.c_str(), F_OK) == 0 && ++n);
+    ::rename(file.path.c_str(), target.c_str());
+    files_.erase(it);
+    // Delta output in the new segment starts with a keyframe.
+    file_generation_.fetch_add(1, std::memory_order_acq_rel);
+
+    {
+        std::unique_lock lock(finaliser_mutex_);
+        finished_segments_.push_back(std::move(segment));
+        if (!finaliser_.joinable()) {
+            finaliser_ =
+                std::thread(&MetricsCollector::finalise_segments, this);
+        }
+    }
+    finaliser_cv_.notify_one();
+}
+
+void metrics::MetricsCollector::close_files() noexcept {
+    for (auto &[filename, file] : files_) {
+        if (file.compressor) {
+            try {
+                std::string trailer;
+                file.compressor->finish(trailer);
+                write_all(file.fd, trailer);
+            } catch (...) {
+            }
         }
+        ::close(file.fd);
     }
-}
\ No newline at end of file
+    files_.clear();
+}
+
+void metrics::MetricsCollector::finalise_segments() {
+    std::vector<FinishedSegment> segments;
+    while (true) {
+        {
+            std::unique_lock lock(finaliser_mutex_);
+            finaliser_cv_.wait(lock, [this] {
+                return !finished_segments_.empty() || finaliser_stopped_;
+            });
+            if (finished_segments_.empty()) {
+                return;
+            }
+            std::swap(segments, finished_segments_);
+        }
+        for (auto &segment : segments) {
+            write_all(segment.fd, segment.trailer);
+            if (sync_data_) {
+                ::fdatasync(segment.fd);
+            }
+            ::close(segment.fd);
+            if (segment.options.max_segments > 0) {
+                prune_segments(segment.filename, segment.options);
+            }
+        }
+        segments.clear();
+    }
+}
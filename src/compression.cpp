@@ -0,0 +1,324 @@
+#include "compression.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#ifdef METRICS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+
+// LZ4 frame format: magic, a descriptor with linked 64 KiB blocks and no
+// checksums, then blocks of [u32 size][data] and a zero end mark. A size
+// with the high bit set marks a block stored uncompressed. Linked blocks
+// may refer to the previous 64 KiB of the frame, so a flush ends a block
+// without losing the history.
+constexpr uint32_t lz4_magic = 0x184D2204;
+constexpr uint8_t lz4_flags = 0x40;
+constexpr uint8_t lz4_block_descriptor = 0x40;
+constexpr std::size_t lz4_block_size = 64 * 1024;
+constexpr uint32_t lz4_uncompressed = 0x80000000;
+
+// Block format limits: matches are at least 4 bytes, the last match starts
+// 12 bytes before the end and the last 5 bytes are always literals.
+constexpr std::size_t min_match = 4;
+constexpr std::size_t match_limit = 12;
+constexpr std::size_t last_literals = 5;
+constexpr std::size_t max_offset = 65535;
+constexpr unsigned hash_bits = 12;
+
+uint32_t read_u32(const char *at) noexcept {
+    uint32_t value;
+    std::memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+void append_u32(std::string &out, uint32_t value) {
+    const char bytes[4] = {
+        static_cast<char>(value), static_cast<char>(value >> 8),
+        static_cast<char>(value >> 16), static_cast<char>(value >> 24)
+    };
+    out.append(bytes, sizeof(bytes));
+}
+
+uint32_t rotl(uint32_t value, unsigned bits) noexcept {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// xxHash32 of inputs shorter than 16 bytes, enough for the frame
+// descriptor checksum.
+uint32_t xxh32_short(std::string_view data) noexcept {
+    constexpr uint32_t prime1 = 2654435761U;
+    constexpr uint32_t prime2 = 2246822519U;
+    constexpr uint32_t prime3 = 3266489917U;
+    constexpr uint32_t prime4 = 668265263U;
+    constexpr uint32_t prime5 = 374761393U;
+    uint32_t hash = prime5 + static_cast<uint32_t>(data.size());
+    std::size_t i = 0;
+    for (; i + 4 <= data.size(); i += 4) {
+        hash = rotl(hash + read_u32(data.data() + i) * prime3, 17) * prime4;
+    }
+    for (; i < data.size(); ++i) {
+        hash += static_cast<uint8_t>(data[i]) * prime5;
+        hash = rotl(hash, 11) * prime1;
+    }
+    hash ^= hash >> 15;
+    hash *= prime2;
+    hash ^= hash >> 13;
+    hash *= prime3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+void append_length(std::string &out, std::size_t length) {
+    for (; length >= 255; length -= 255) {
+        out += static_cast<char>(255);
+    }
+    out += static_cast<char>(length);
+}
+
+void append_sequence(
+    std::string &out,
+    std::string_view literals,
+    std::size_t offset,
+    std::size_t match_length
+) {
+    const std::size_t literal_code = std::min<std::size_t>(literals.size(), 15);
+    const std::size_t match_code =
+        match_length == 0 ? 0 : std::min<std::size_t>(match_length - 4, 15);
+    out += static_cast<char>((literal_code << 4) | match_code);
+    if (literal_code == 15) {
+        append_length(out, literals.size() - 15);
+    }
+    out += literals;
+    if (match_length == 0) {
+        return;
+    }
+    out += static_cast<char>(offset);
+    out += static_cast<char>(offset >> 8);
+    if (match_code == 15) {
+        append_length(out, match_length - 4 - 15);
+    }
+}
+
+// Greedy LZ4 compression of window[begin, end) with a single-entry hash
+// table, the same trade-off as the reference implementation's fast mode.
+// window before begin is the history of the frame. The table holds
+// positions in the frame counted from base, the frame position of window[0];
+// they are truncated to 32 bits, and every candidate is checked against the
+// data, so stale entries only cost a missed match.
+void compress_lz4_block(
+    std::string_view window,
+    std::size_t begin,
+    std::size_t end,
+    uint64_t base,
+    std::string &out,
+    std::array<uint32_t, 1 << hash_bits> &table
+) {
+    const char *src = window.data();
+    std::size_t anchor = begin;
+    std::size_t i = begin;
+    while (end - begin > match_limit && i < end - match_limit) {
+        const uint32_t sequence = read_u32(src + i);
+        const uint32_t hash = (sequence * 2654435761U) >> (32 - hash_bits);
+        const auto position = static_cast<uint32_t>(base + i);
+        const std::size_t distance = position - table[hash];
+        table[hash] = position;
+        if (distance == 0 || distance > max_offset || distance > i ||
+            read_u32(src + i - distance) != sequence) {
+            ++i;
+            continue;
+        }
+        const std::size_t match = i - distance;
+        std::size_t length = min_match;
+        while (i + length < end - last_literals &&
+               src[match + length] == src[i + length]) {
+            ++length;
+        }
+        append_sequence(
+            out, window.substr(anchor, i - anchor), distance, length
+        );
+        i += length;
+        anchor = i;
+    }
+    append_sequence(out, window.substr(anchor, end - anchor), 0, 0);
+}
+
+class Lz4Compressor : public metrics::StreamCompressor {
+public:
+    void compress(std::string_view data, std::string &out) override {
+        window_ += data;
+        while (window_.size() - pending_ >= lz4_block_size) {
+            append_block(lz4_block_size, out);
+        }
+    }
+
+    void flush(std::string &out) override {
+        if (window_.size() > pending_) {
+            append_block(window_.size() - pending_, out);
+        }
+    }
+
+    void finish(std::string &out) override {
+        flush(out);
+        if (started_) {
+            append_u32(out, 0);
+            started_ = false;
+        }
+        // The next frame starts without history.
+        base_ += window_.size();
+        window_.clear();
+        pending_ = 0;
+    }
+
+private:
+    // Compresses the next size bytes after pending_ into one block.
+    void append_block(std::size_t size, std::string &out) {
+        if (!started_) {
+            append_u32(out, lz4_magic);
+            const char descriptor[2] = {
+                static_cast<char>(lz4_flags),
+                static_cast<char>(lz4_block_descriptor)
+            };
+            out.append(descriptor, sizeof(descriptor));
+            out += static_cast<char>(
+                xxh32_short(std::string_view(descriptor, 2)) >> 8
+            );
+            started_ = true;
+        }
+        const std::size_t size_at = out.size();
+        append_u32(out, 0);
+        compress_lz4_block(
+            window_, pending_, pending_ + size, base_, out, table_
+        );
+        const std::size_t compressed = out.size() - size_at - 4;
+        uint32_t header = static_cast<uint32_t>(compressed);
+        if (compressed >= size) {
+            out.resize(size_at + 4);
+            out.append(window_, pending_, size);
+            header = static_cast<uint32_t>(size) | lz4_uncompressed;
+        }
+        for (int b = 0; b < 4; ++b) {
+            out[size_at + b] = static_cast<char>(header >> (8 * b));
+        }
+        pending_ += size;
+
+        // Keep one block of history; trimming only once two have built up
+        // keeps the copying linear in the input.
+        if (pending_ >= 2 * lz4_block_size) {
+            const std::size_t drop = pending_ - lz4_block_size;
+            window_.erase(0, drop);
+            pending_ -= drop;
+            base_ += drop;
+        }
+    }
+
+    bool started_ = false;
+    // History of the frame followed by data not yet compressed, which
+    // starts at pending_; base_ is the frame position of window_[0].
+    std::string window_;
+    std::size_t pending_ = 0;
+    uint64_t base_ = 0;
+    std::array<uint32_t, 1 << hash_bits> table_{};
+};
+
+#ifdef METRICS_HAVE_ZLIB
+class GzipCompressor : public metrics::StreamCompressor {
+public:
+    GzipCompressor() {
+        // 16 added to the window bits selects the gzip wrapper. The fastest
+        // level keeps the writer thread from falling behind.
+        if (deflateInit2(
+                &stream_, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY
+            ) != Z_OK) {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+    }
+
+    ~GzipCompressor() override {
+        deflateEnd(&stream_);
+    }
+
+    GzipCompressor(const GzipCompressor &) = delete;
+    GzipCompressor &operator=(const GzipCompressor &) = delete;
+
+    void compress(std::string_view data, std::string &out) override {
+        if (!data.empty()) {
+            run(data, Z_NO_FLUSH, out);
+        }
+    }
+
+    void flush(std::string &out) override {
+        // A sync flush ends on a byte boundary, so everything so far can be
+        // decompressed.
+        run({}, Z_SYNC_FLUSH, out);
+    }
+
+    void finish(std::string &out) override {
+        run({}, Z_FINISH, out);
+        deflateReset(&stream_);
+    }
+
+private:
+    void run(std::string_view data, int flush, std::string &out) {
+        stream_.next_in =
+            reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        stream_.avail_in = static_cast<uInt>(data.size());
+        while (true) {
+            const std::size_t used = out.size();
+            const std::size_t room = deflateBound(&stream_, data.size()) + 64;
+            out.resize(used + room);
+            stream_.next_out = reinterpret_cast<Bytef *>(out.data() + used);
+            stream_.avail_out = static_cast<uInt>(room);
+            const int status = deflate(&stream_, flush);
+            out.resize(used + room - stream_.avail_out);
+            if (status == Z_STREAM_END ||
+                (status == Z_OK && stream_.avail_out > 0) ||
+                status == Z_BUF_ERROR) {
+                return;
+            }
+            if (status != Z_OK) {
+                throw std::runtime_error("deflate failed");
+            }
+        }
+    }
+
+    z_stream stream_{};
+};
+#endif
+
+}  // namespace
+
+std::unique_ptr<metrics::StreamCompressor>
+metrics::make_compressor(Compression compression) {
+    switch (compression) {
+        case Compression::Lz4:
+            return std::make_unique<Lz4Compressor>();
+        case Compression::Gzip:
+#ifdef METRICS_HAVE_ZLIB
+            return std::make_unique<GzipCompressor>();
+#else
+            throw std::invalid_argument("gzip needs zlib, which was not found");
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+std::string_view metrics::compression_extension(Compression compression
+) noexcept {
+    switch (compression) {
+        case Compression::Lz4:
+            return ".lz4";
+        case Compression::Gzip:
+            return ".gz";
+        default:
+            return {};
+    }
+}
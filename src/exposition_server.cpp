@@ -0,0 +1,554 @@
+#include "exposition_server.hpp"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+#ifdef METRICS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t max_request_size = 8192;
+constexpr std::string_view content_type =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+bool compress_gzip(std::string_view input, std::string &out) {
+#ifdef METRICS_HAVE_ZLIB
+    z_stream stream{};
+    // 16 added to the window bits selects the gzip wrapper.
+    if (deflateInit2(
+            &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY
+        ) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&stream, input.size()));
+    stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    const int status = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        out.clear();
+        return false;
+    }
+    return true;
+#else
+    (void)input;
+    (void)out;
+    return false;
+#endif
+}
+
+bool iequals(std::string_view a, std::string_view b) noexcept {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) ==
+                      std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// Whether a comma-separated header value lists token, ignoring case and
+// parameters such as ";q=0.5".
+bool has_token(std::string_view value, std::string_view token) noexcept {
+    while (!value.empty()) {
+        const auto comma = value.find(',');
+        auto item = value.substr(0, comma);
+        item = item.substr(0, item.find(';'));
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+            item.remove_suffix(1);
+        }
+        if (iequals(item, token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Value of the first header called name, with surrounding spaces removed.
+std::string_view
+header_value(std::string_view headers, std::string_view name) noexcept {
+    while (!headers.empty()) {
+        const auto end = headers.find("\r\n");
+        const auto line = headers.substr(0, end);
+        const auto colon = line.find(':');
+        if (colon != std::string_view::npos &&
+            iequals(line.substr(0, colon), name)) {
+            auto value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') {
+                value.remove_prefix(1);
+            }
+            while (!value.empty() && value.back() == ' ') {
+                value.remove_suffix(1);
+            }
+            return value;
+        }
+        if (end == std::string_view::npos) {
+            break;
+        }
+        headers.remove_prefix(end + 2);
+    }
+    return {};
+}
+
+void close_descriptor(int &fd) noexcept {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+}  // namespace
+
+struct metrics::ExpositionServer::Connection {
+    int fd;
+    std::string input;
+    // Status line and headers, then the body, which points into snapshot.
+    std::string head;
+    std::shared_ptr<const Snapshot> snapshot;
+    std::string_view body;
+    std::size_t sent = 0;
+    bool close_after = false;
+    Clock::time_point last_active;
+
+    bool pending() const noexcept {
+        return sent < head.size() + body.size();
+    }
+};
+
+metrics::ExpositionServer::ExpositionServer(
+    MetricsCollector &collector,
+    ExpositionOptions options
+)
+    : collector_(collector),
+      options_(std::move(options)),
+      listener_(-1),
+      wake_pipe_{-1, -1},
+      port_(0),
+      gzip_requested_(false),
+      stopped_(false) {
+    collector_.attach_exposition();
+    auto fail = [this](const char *what) {
+        const int error = errno;
+        collector_.detach_exposition();
+        close_descriptor(listener_);
+        close_descriptor(wake_pipe_[0]);
+        close_descriptor(wake_pipe_[1]);
+        throw std::system_error(error, std::generic_category(), what);
+    };
+
+    if (::pipe2(wake_pipe_, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fail("pipe2");
+    }
+    if (options_.unix_socket.empty()) {
+        listener_ = ::socket(
+            AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0
+        );
+        if (listener_ < 0) {
+            fail("socket");
+        }
+        const int reuse = 1;
+        ::setsockopt(
+            listener_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)
+        );
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(options_.port);
+        if (::bind(
+                listener_, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)
+            ) != 0) {
+            fail("bind");
+        }
+        socklen_t length = sizeof(address);
+        if (::getsockname(
+                listener_, reinterpret_cast<sockaddr *>(&address), &length
+            ) != 0) {
+            fail("getsockname");
+        }
+        port_ = ntohs(address.sin_port);
+    } else {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (options_.unix_socket.size() >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            fail(options_.unix_socket.c_str());
+        }
+        std::memcpy(
+            address.sun_path, options_.unix_socket.data(),
+            options_.unix_socket.size()
+        );
+        listener_ = ::socket(
+            AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0
+        );
+        if (listener_ < 0) {
+            fail("socket");
+        }
+        // A socket file left behind by a previous run blocks bind().
+        ::unlink(options_.unix_socket.c_str());
+        if (::bind(
+                listener_, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)
+            ) != 0) {
+            fail(options_.unix_socket.c_str());
+        }
+    }
+    if (::listen(listener_, SOMAXCONN) != 0) {
+        fail("listen");
+    }
+
+    std::shared_ptr<Snapshot> spare;
+    publish_snapshot(spare);
+    render_thread_ = std::thread(&ExpositionServer::render_loop, this);
+    serve_thread_ = std::thread(&ExpositionServer::serve_loop, this);
+}
+
+metrics::ExpositionServer::~ExpositionServer() {
+    {
+        std::unique_lock lock(render_mutex_);
+        stopped_ = true;
+    }
+    render_cv_.notify_one();
+    const char wake = 0;
+    while (::write(wake_pipe_[1], &wake, 1) < 0 && errno == EINTR) {
+    }
+    render_thread_.join();
+    serve_thread_.join();
+    collector_.detach_exposition();
+
+    close_descriptor(listener_);
+    close_descriptor(wake_pipe_[0]);
+    close_descriptor(wake_pipe_[1]);
+    if (!options_.unix_socket.empty()) {
+        ::unlink(options_.unix_socket.c_str());
+    }
+}
+
+uint16_t metrics::ExpositionServer::port() const noexcept {
+    return port_;
+}
+
+void metrics::ExpositionServer::render_loop() {
+    std::shared_ptr<Snapshot> spare;
+    std::unique_lock lock(render_mutex_);
+    while (!render_cv_.wait_for(lock, options_.interval, [this] {
+        return stopped_;
+    })) {
+        lock.unlock();
+        publish_snapshot(spare);
+        lock.lock();
+    }
+}
+
+// Renders into the previous snapshot when no response refers to it any
+// more, so steady-state rendering reuses the same two sets of buffers.
+// Responses drop their references under snapshot_mutex_, and the count is
+// checked under it too, which orders their last reads before the reuse.
+void metrics::ExpositionServer::publish_snapshot(
+    std::shared_ptr<Snapshot> &spare
+) {
+    bool reusable;
+    {
+        std::unique_lock lock(snapshot_mutex_);
+        reusable = spare && spare.use_count() == 1;
+    }
+    if (!reusable) {
+        spare = std::make_shared<Snapshot>();
+    }
+    spare->text.clear();
+    spare->gzip.clear();
+    collector_.render_openmetrics(spare->text);
+    if (gzip_requested_.load(std::memory_order_relaxed)) {
+        compress_gzip(spare->text, spare->gzip);
+    }
+
+    std::unique_lock lock(snapshot_mutex_);
+    std::swap(spare, snapshot_);
+}
+
+std::shared_ptr<const metrics::ExpositionServer::Snapshot>
+metrics::ExpositionServer::current_snapshot() const {
+    std::unique_lock lock(snapshot_mutex_);
+    return snapshot_;
+}
+
+void metrics::ExpositionServer::release_snapshot(Connection &connection
+) const {
+    std::unique_lock lock(snapshot_mutex_);
+    connection.snapshot.reset();
+}
+
+void metrics::ExpositionServer::serve_loop() {
+    std::vector<Connection> connections;
+    std::vector<pollfd> descriptors;
+    while (true) {
+        descriptors.clear();
+        descriptors.push_back({wake_pipe_[0], POLLIN, 0});
+        const bool accepting = connections.size() < options_.max_connections;
+        const short accept_events = accepting ? POLLIN : 0;
+        descriptors.push_back({listener_, accept_events, 0});
+        for (const auto &connection : connections) {
+            const short events =
+                connection.pending() ? POLLOUT : static_cast<short>(POLLIN);
+            descriptors.push_back({connection.fd, events, 0});
+        }
+
+        if (::poll(descriptors.data(), descriptors.size(), 1000) < 0 &&
+            errno != EINTR) {
+            break;
+        }
+        if (descriptors[0].revents != 0) {
+            break;
+        }
+
+        const auto now = Clock::now();
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < connections.size(); ++i) {
+            auto &connection = connections[i];
+            const short revents = descriptors[i + 2].revents;
+            bool open = true;
+            if (revents & (POLLERR | POLLNVAL)) {
+                open = false;
+            } else if (revents != 0) {
+                connection.last_active = now;
+                if (revents & (POLLIN | POLLHUP)) {
+                    char chunk[4096];
+                    while (true) {
+                        const ssize_t got =
+                            ::recv(connection.fd, chunk, sizeof(chunk), 0);
+                        if (got > 0) {
+                            connection.input.append(
+                                chunk, static_cast<std::size_t>(got)
+                            );
+                            continue;
+                        }
+                        if (got < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        // Orderly shutdown or a real error, not EAGAIN.
+                        if (got == 0 ||
+                            (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                            open = false;
+                        }
+                        break;
+                    }
+                }
+                if (open) {
+                    open = process(connection);
+                }
+            } else if (now - connection.last_active > options_.idle_timeout) {
+                open = false;
+            }
+
+            if (open) {
+                if (kept != i) {
+                    connections[kept] = std::move(connection);
+                }
+                ++kept;
+            } else {
+                release_snapshot(connection);
+                ::close(connection.fd);
+            }
+        }
+        connections.resize(kept);
+
+        if (descriptors[1].revents & POLLIN) {
+            while (connections.size() < options_.max_connections) {
+                const int fd = ::accept4(
+                    listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC
+                );
+                if (fd < 0) {
+                    break;
+                }
+                Connection connection;
+                connection.fd = fd;
+                connection.last_active = now;
+                connections.push_back(std::move(connection));
+            }
+        }
+    }
+
+    for (auto &connection : connections) {
+        release_snapshot(connection);
+        ::close(connection.fd);
+    }
+}
+
+// Answers complete requests one at a time, in order, for as long as the
+// socket accepts the responses. Returns false when the connection is done.
+bool metrics::ExpositionServer::process(Connection &connection) {
+    while (true) {
+        if (connection.pending()) {
+            if (!send_pending(connection)) {
+                return false;
+            }
+            if (connection.pending()) {
+                return true;
+            }
+            continue;
+        }
+        const auto end = connection.input.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            return connection.input.size() <= max_request_size;
+        }
+        respond(
+            connection, std::string_view(connection.input).substr(0, end + 2)
+        );
+        connection.input.erase(0, end + 4);
+    }
+}
+
+void metrics::ExpositionServer::respond(
+    Connection &connection,
+    std::string_view request
+) {
+    const auto line_end = request.find("\r\n");
+    const auto line = request.substr(0, line_end);
+    const auto headers = request.substr(line_end + 2);
+
+    const auto method_end = line.find(' ');
+    const auto target_end = line.find(' ', method_end + 1);
+    const auto method = line.substr(0, method_end);
+    std::string_view target;
+    if (method_end != std::string_view::npos) {
+        target = line.substr(method_end + 1, target_end - method_end - 1);
+        target = target.substr(0, target.find('?'));
+    }
+    const auto version = target_end == std::string_view::npos
+                             ? std::string_view{}
+                             : line.substr(target_end + 1);
+
+    const auto connection_header = header_value(headers, "Connection");
+    bool keep_alive = version == "HTTP/1.1"
+                          ? !has_token(connection_header, "close")
+                          : has_token(connection_header, "keep-alive");
+
+    std::string_view status = "200 OK";
+    bool head_only = method == "HEAD";
+    if (version != "HTTP/1.1" && version != "HTTP/1.0") {
+        status = "400 Bad Request";
+        keep_alive = false;
+    } else if (!header_value(headers, "Transfer-Encoding").empty() ||
+               (!header_value(headers, "Content-Length").empty() &&
+                header_value(headers, "Content-Length") != "0")) {
+        // Request bodies are never expected; skipping them is not worth it.
+        status = "400 Bad Request";
+        keep_alive = false;
+    } else if (method != "GET" && method != "HEAD") {
+        status = "405 Method Not Allowed";
+    } else if (target != "/metrics" && target != "/") {
+        status = "404 Not Found";
+    }
+
+    auto &head = connection.head;
+    head.clear();
+    head += "HTTP/1.1 ";
+    head += status;
+    head += "\r\n";
+    release_snapshot(connection);
+    connection.body = {};
+    if (status == "200 OK") {
+        const bool gzip = has_token(
+            header_value(headers, "Accept-Encoding"), "gzip"
+        );
+        if (gzip) {
+            gzip_requested_.store(true, std::memory_order_relaxed);
+        }
+        connection.snapshot = current_snapshot();
+        head += "Content-Type: ";
+        head += content_type;
+        head += "\r\n";
+        if (gzip && !connection.snapshot->gzip.empty()) {
+            head += "Content-Encoding: gzip\r\n";
+            connection.body = connection.snapshot->gzip;
+        } else {
+            connection.body = connection.snapshot->text;
+        }
+        head += "Vary: Accept-Encoding\r\n";
+    } else if (status == "405 Method Not Allowed") {
+        head += "Allow: GET, HEAD\r\n";
+    }
+    head += "Content-Length: ";
+    head += std::to_string(connection.body.size());
+    head += "\r\n";
+    head += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    head += "\r\n";
+    if (head_only) {
+        connection.body = {};
+    }
+    connection.sent = 0;
+    connection.close_after = !keep_alive;
+}
+
+// Writes as much of the pending response as the socket takes. Returns false
+// on errors and after the last response of a closing connection.
+bool metrics::ExpositionServer::send_pending(Connection &connection) {
+    while (connection.pending()) {
+        iovec parts[2];
+        int count = 0;
+        if (connection.sent < connection.head.size()) {
+            parts[count++] = {
+                connection.head.data() + connection.sent,
+                connection.head.size() - connection.sent
+            };
+        }
+        const std::size_t body_sent =
+            connection.sent > connection.head.size()
+                ? connection.sent - connection.head.size()
+                : 0;
+        if (body_sent < connection.body.size()) {
+            parts[count++] = {
+                const_cast<char *>(connection.body.data()) + body_sent,
+                connection.body.size() - body_sent
+            };
+        }
+        msghdr message{};
+        message.msg_iov = parts;
+        message.msg_iovlen = static_cast<std::size_t>(count);
+        const ssize_t written =
+            ::sendmsg(connection.fd, &message, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection.sent += static_cast<std::size_t>(written);
+    }
+
+    release_snapshot(connection);
+    connection.body = {};
+    connection.head.clear();
+    connection.sent = 0;
+    return !connection.close_after;
+}
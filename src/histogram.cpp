@@ -1,89 +1,278 @@
 #include "histogram.hpp"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
-#include <cstring>
-#include <iomanip>
 #include <limits>
 #include <memory>
 #include <mutex>
-#include <shared_mutex>
-#include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
+#include "openmetrics.hpp"
+
+namespace {
+
+constexpr uint64_t hot_bit = uint64_t{1} << 63;
+
+}  // namespace
 
 void metrics::Histogram::observe(double value) noexcept {
-    std::unique_lock lock(mutex_);
-    is_cached = false;
     auto &data = *inner_;
-    data.sum += value;
-    data.count++;
-    auto it = std::lower_bound(data.buckets.begin(), data.buckets.end(), value);
-    if (it != data.buckets.end()) {
-        size_t index = std::distance(data.buckets.begin(), it);
-        data.counters[index]++;
+    const std::size_t index = bucket_index(value);
+    // Acquire pairs with the flip in swap_halves, so a half is seen
+    // cleared before it is written to again.
+    const std::size_t half =
+        data.started.fetch_add(1, std::memory_order_acquire) >> 63;
+    data.counters[half][index].fetch_add(1, std::memory_order_relaxed);
+    data.sum[half]->fetch_add(value, std::memory_order_relaxed);
+    data.finished[half].value.fetch_add(1, std::memory_order_release);
+    data.changed.mark();
+}
+
+std::size_t metrics::Histogram::hot_half() const noexcept {
+    return inner_->started.load(std::memory_order_relaxed) >> 63;
+}
+
+std::size_t metrics::Histogram::swap_halves() noexcept {
+    auto &data = *inner_;
+    // Only collectors change the bit, and they hold collect_mutex.
+    const uint64_t flipped =
+        (data.started.load(std::memory_order_relaxed) & hot_bit) ^ hot_bit;
+    const uint64_t started =
+        data.started.exchange(flipped, std::memory_order_acq_rel);
+    const std::size_t cold = started >> 63;
+    const uint64_t count = started & ~hot_bit;
+    // Observers still in the old half are a few instructions from done,
+    // unless they were preempted.
+    for (int spins = 0;
+         data.finished[cold].value.load(std::memory_order_acquire) != count;
+         ++spins) {
+        if (spins >= 64) {
+            std::this_thread::yield();
+        }
     }
+    data.finished[cold].value.store(0, std::memory_order_relaxed);
+    return cold;
 }
 
-metrics::Histogram::Snapshot metrics::Histogram::get() const noexcept {
-    std::shared_lock lock(mutex_);
-    return {inner_->sum, inner_->count, inner_->buckets, inner_->counters};
+void metrics::Histogram::detect_layout() noexcept {
+    auto &data = *inner_;
+    const auto &bounds = data.buckets;
+    const std::size_t finite = bounds.size() - 1;
+    if (finite < 3 || !std::isfinite(bounds.front()) ||
+        !std::isfinite(bounds[finite - 1])) {
+        return;
+    }
+
+    constexpr double tolerance = 1e-6;
+    const double first = bounds.front();
+    const double last = bounds[finite - 1];
+    const double steps = static_cast<double>(finite - 1);
+
+    const double width = (last - first) / steps;
+    if (width > 0.0) {
+        bool linear = true;
+        for (std::size_t i = 1; i < finite && linear; ++i) {
+            const double expected = first + width * static_cast<double>(i);
+            linear = std::abs(bounds[i] - expected) <=
+                     tolerance * std::max(std::abs(expected), width);
+        }
+        if (linear) {
+            data.layout = Layout::Linear;
+            data.origin = first;
+            data.scale = 1.0 / width;
+            return;
+        }
+    }
+
+    if (first > 0.0) {
+        const double log_factor = std::log2(last / first) / steps;
+        if (!(log_factor > 0.0)) {
+            return;
+        }
+        for (std::size_t i = 1; i < finite; ++i) {
+            const double expected =
+                first * std::exp2(log_factor * static_cast<double>(i));
+            if (std::abs(bounds[i] - expected) > tolerance * expected) {
+                return;
+            }
+        }
+        data.layout = Layout::Exponential;
+        data.origin = first;
+        data.scale = 1.0 / log_factor;
+    }
 }
 
-std::string_view metrics::Histogram::name() const noexcept {
-    return name_;
+std::size_t metrics::Histogram::bucket_index(double value) const noexcept {
+    const auto &data = *inner_;
+    const double *bounds = data.buckets.data();
+    const std::size_t size = data.buckets.size();
+
+    if (data.layout == Layout::Arbitrary) {
+        // Branchless lower_bound: the loop trip count depends only on size.
+        const double *base = bounds;
+        std::size_t length = size;
+        while (length > 1) {
+            const std::size_t half = length / 2;
+            base += (base[half - 1] < value) ? half : 0;
+            length -= half;
+        }
+        return static_cast<std::size_t>(base - bounds) + (*base < value);
+    }
+
+    // Also catches NaN, which lower_bound would place into the first bucket.
+    if (!(value > bounds[0])) {
+        return 0;
+    }
+    const std::size_t last = size - 2;
+    if (value > bounds[last]) {
+        return last + 1;
+    }
+
+    // The answer lies in [1, last]. The estimate is exact up to rounding, so
+    // the fix-up loops below run at most once or twice.
+    const double estimate =
+        data.layout == Layout::Linear
+            ? (value - data.origin) * data.scale
+            : std::log2(value / data.origin) * data.scale;
+    std::size_t index = static_cast<std::size_t>(std::clamp(
+        std::ceil(estimate), 1.0, static_cast<double>(last)
+    ));
+    while (bounds[index - 1] >= value) {
+        --index;
+    }
+    while (bounds[index] < value) {
+        ++index;
+    }
+    return index;
+}
+
+metrics::Histogram::Layout metrics::Histogram::layout() const noexcept {
+    return inner_->layout;
 }
 
-std::string metrics::Histogram::value_as_str() const {
-    if (is_cached) {
-        return cached_value;
+metrics::Histogram::Snapshot metrics::Histogram::get() const {
+    auto &data = *inner_;
+    Snapshot snapshot{0.0, 0, data.buckets, {}};
+    snapshot.counters.resize(data.buckets.size());
+    std::lock_guard lock(data.collect_mutex);
+    const std::size_t half = hot_half();
+    for (std::size_t i = 0; i < data.buckets.size(); ++i) {
+        snapshot.counters[i] =
+            data.counters[half][i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.counters[i];
     }
-    Snapshot snapshot = get();
+    snapshot.sum = data.sum[half]->load(std::memory_order_relaxed);
+    return snapshot;
+}
 
-    std::size_t approx_length = 256 + snapshot.buckets.size() * 64;
-    std::string result;
-    result.reserve(approx_length);
-    uint64_t sum = 0;
+std::string_view metrics::Histogram::name() const noexcept {
+    return name_;
+}
 
-    result += '{';
-    for (std::size_t i = 0; i < snapshot.buckets.size(); ++i) {
-        sum += snapshot.counters[i];
-        result += "\"";
-        result += name_;
-        result += "_bucket{le=";
-        if (std::isinf(snapshot.buckets[i])) {
-            result += "+Inf";
+void metrics::Histogram::format_labels() {
+    auto &data = *inner_;
+    data.labels.reserve(data.buckets.size());
+    for (double bound : data.buckets) {
+        std::string label = "\"";
+        label += name_;
+        label += "_bucket{le=";
+        if (std::isinf(bound)) {
+            label += "+Inf";
         } else {
-            result += std::to_string(snapshot.buckets[i]);
+            append_number(label, bound);
         }
-        result += "}\" ";
-        result += std::to_string(sum);
-        result += " ";
+        label += "}\" ";
+        data.labels.push_back(std::move(label));
+    }
+}
+
+uint64_t metrics::Histogram::append_half(
+    std::string &out,
+    std::size_t half,
+    bool clear
+) const {
+    const auto &data = *inner_;
+    uint64_t cumulative = 0;
+
+    out += '{';
+    for (std::size_t i = 0; i < data.buckets.size(); ++i) {
+        auto &counter = data.counters[half][i];
+        cumulative += clear ? counter.exchange(0, std::memory_order_relaxed)
+                            : counter.load(std::memory_order_relaxed);
+        out += data.labels[i];
+        append_number(out, cumulative);
+        out += ' ';
     }
 
-    result += " \"";
-    result += name_;
-    result += "_sum\" ";
-    result += std::to_string(snapshot.sum);
-    result += " ";
+    auto &sum = *data.sum[half];
+    out += " \"";
+    out += name_;
+    out += "_sum\" ";
+    append_number(
+        out, clear ? sum.exchange(0.0, std::memory_order_relaxed)
+                   : sum.load(std::memory_order_relaxed)
+    );
+    out += ' ';
 
-    result += " \"";
-    result += name_;
-    result += "_count\" ";
-    result += std::to_string(snapshot.count);
-    result += "}";
+    out += " \"";
+    out += name_;
+    out += "_count\" ";
+    append_number(out, cumulative);
+    out += '}';
+    return cumulative;
+}
+
+void metrics::Histogram::append_to(std::string &out) const {
+    std::lock_guard lock(inner_->collect_mutex);
+    append_half(out, hot_half(), false);
+}
 
-    is_cached = true;
-    cached_value = result;
-    return result;
+std::string_view metrics::Histogram::openmetrics_type() const noexcept {
+    return "histogram";
+}
+
+void metrics::Histogram::append_openmetrics_samples(std::string &out) const {
+    auto &data = *inner_;
+    const auto name = split_metric_name(name_);
+    std::lock_guard lock(data.collect_mutex);
+    const std::size_t half = hot_half();
+    uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < data.buckets.size(); ++i) {
+        cumulative += data.counters[half][i].load(std::memory_order_relaxed);
+        append_bucket_sample(out, name, data.buckets[i], cumulative);
+    }
+    append_value_sample(
+        out, name, "_sum", data.sum[half]->load(std::memory_order_relaxed)
+    );
+    append_value_sample(out, name, "_count", cumulative);
 }
 
 void metrics::Histogram::reset() noexcept {
-    for (auto &counter : inner_->counters) {
-        counter = 0;
+    auto &data = *inner_;
+    std::lock_guard lock(data.collect_mutex);
+    const std::size_t half = swap_halves();
+    uint64_t cleared = 0;
+    for (std::size_t i = 0; i < data.buckets.size(); ++i) {
+        cleared +=
+            data.counters[half][i].exchange(0, std::memory_order_relaxed);
+    }
+    data.sum[half]->exchange(0.0, std::memory_order_relaxed);
+    if (cleared > 0) {
+        data.changed.mark();
     }
-    inner_->sum = 0;
-    inner_->count = 0;
+}
+
+void metrics::Histogram::collect_and_reset(std::string &out) {
+    std::lock_guard lock(inner_->collect_mutex);
+    if (append_half(out, swap_halves(), true) > 0) {
+        inner_->changed.mark();
+    }
+}
+
+bool metrics::Histogram::consume_changed() noexcept {
+    return inner_->changed.consume();
 }
 
 std::vector<double>
@@ -0,0 +1,271 @@
+#include "io_uring.hpp"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef METRICS_HAVE_IO_URING
+#include <linux/io_uring.h>
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params *params) noexcept {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(
+    int fd,
+    unsigned to_submit,
+    unsigned min_complete,
+    unsigned flags
+) noexcept {
+    return static_cast<int>(::syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0
+    ));
+}
+
+std::atomic_ref<unsigned> ring_word(void *base, unsigned offset) noexcept {
+    return std::atomic_ref<unsigned>(
+        *reinterpret_cast<unsigned *>(static_cast<char *>(base) + offset)
+    );
+}
+
+}  // namespace
+
+struct metrics::IoUring::Rings {
+    int fd = -1;
+    void *sq = MAP_FAILED;
+    std::size_t sq_size = 0;
+    void *cq = MAP_FAILED;
+    std::size_t cq_size = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    std::size_t sqes_size = 0;
+    io_uring_params params{};
+
+    ~Rings() {
+        if (sqes != MAP_FAILED) {
+            ::munmap(sqes, sqes_size);
+        }
+        if (cq != MAP_FAILED && cq != sq) {
+            ::munmap(cq, cq_size);
+        }
+        if (sq != MAP_FAILED) {
+            ::munmap(sq, sq_size);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    std::atomic_ref<unsigned> sq_head() noexcept {
+        return ring_word(sq, params.sq_off.head);
+    }
+
+    std::atomic_ref<unsigned> sq_tail() noexcept {
+        return ring_word(sq, params.sq_off.tail);
+    }
+
+    unsigned *sq_array() noexcept {
+        return reinterpret_cast<unsigned *>(
+            static_cast<char *>(sq) + params.sq_off.array
+        );
+    }
+
+    std::atomic_ref<unsigned> cq_head() noexcept {
+        return ring_word(cq, params.cq_off.head);
+    }
+
+    std::atomic_ref<unsigned> cq_tail() noexcept {
+        return ring_word(cq, params.cq_off.tail);
+    }
+
+    const io_uring_cqe *cqes() noexcept {
+        return reinterpret_cast<const io_uring_cqe *>(
+            static_cast<char *>(cq) + params.cq_off.cqes
+        );
+    }
+
+    // Next free submission entry, already cleared and placed in the array.
+    io_uring_sqe &next_sqe(unsigned prepared) noexcept {
+        const unsigned mask = params.sq_entries - 1;
+        const unsigned tail =
+            sq_tail().load(std::memory_order_relaxed) + prepared;
+        io_uring_sqe &sqe = sqes[tail & mask];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sq_array()[tail & mask] = tail & mask;
+        return sqe;
+    }
+};
+
+metrics::IoUring::IoUring(unsigned entries)
+    : rings_(std::make_unique<Rings>()), prepared_(0), in_flight_(0) {
+    Rings &r = *rings_;
+    r.fd = io_uring_setup(entries, &r.params);
+    if (r.fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "io_uring");
+    }
+    // Appending needs writes at the current file position, and a single
+    // mapping for both rings keeps this simple; both arrived in Linux 5.6
+    // together with everything else used here.
+    const unsigned required = IORING_FEAT_RW_CUR_POS | IORING_FEAT_SINGLE_MMAP;
+    if ((r.params.features & required) != required) {
+        throw std::system_error(ENOTSUP, std::generic_category(), "io_uring");
+    }
+
+    r.sq_size = r.params.sq_off.array + r.params.sq_entries * sizeof(unsigned);
+    r.cq_size =
+        r.params.cq_off.cqes + r.params.cq_entries * sizeof(io_uring_cqe);
+    r.sq_size = r.cq_size = std::max(r.sq_size, r.cq_size);
+    r.sq = ::mmap(
+        nullptr, r.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r.fd, IORING_OFF_SQ_RING
+    );
+    if (r.sq == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "io_uring");
+    }
+    r.cq = r.sq;
+    r.sqes_size = r.params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(
+        nullptr, r.sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES
+    );
+    if (sqes == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "io_uring");
+    }
+    r.sqes = static_cast<io_uring_sqe *>(sqes);
+}
+
+metrics::IoUring::~IoUring() = default;
+
+unsigned metrics::IoUring::free_entries() const noexcept {
+    const unsigned in_ring = rings_->sq_tail().load(std::memory_order_relaxed) -
+                             rings_->sq_head().load(std::memory_order_acquire);
+    return rings_->params.sq_entries - in_ring - prepared_;
+}
+
+void metrics::IoUring::writev(
+    int fd,
+    const iovec *iov,
+    unsigned count,
+    uint64_t user_data,
+    bool link
+) noexcept {
+    io_uring_sqe &sqe = rings_->next_sqe(prepared_++);
+    sqe.opcode = IORING_OP_WRITEV;
+    sqe.fd = fd;
+    sqe.off = static_cast<uint64_t>(-1);
+    sqe.addr = reinterpret_cast<uint64_t>(iov);
+    sqe.len = count;
+    sqe.user_data = user_data;
+    sqe.flags = link ? IOSQE_IO_LINK : 0;
+}
+
+void metrics::IoUring::fdatasync(int fd, uint64_t user_data, bool link
+) noexcept {
+    io_uring_sqe &sqe = rings_->next_sqe(prepared_++);
+    sqe.opcode = IORING_OP_FSYNC;
+    sqe.fd = fd;
+    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe.user_data = user_data;
+    sqe.flags = link ? IOSQE_IO_LINK : 0;
+}
+
+void metrics::IoUring::submit(std::vector<IoCompletion> &completions) {
+    Rings &r = *rings_;
+    unsigned to_submit = prepared_;
+    // abandon() must not allocate while the kernel writes from our buffers.
+    completions.reserve(completions.size() + to_submit);
+    r.sq_tail().store(
+        r.sq_tail().load(std::memory_order_relaxed) + prepared_,
+        std::memory_order_release
+    );
+    prepared_ = 0;
+
+    while (to_submit > 0 || in_flight_ > 0) {
+        const int result = io_uring_enter(
+            r.fd, to_submit, to_submit + in_flight_, IORING_ENTER_GETEVENTS
+        );
+        if (result < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            throw std::system_error(
+                errno, std::generic_category(), "io_uring_enter"
+            );
+        }
+        const unsigned accepted = std::min<unsigned>(to_submit, result);
+        to_submit -= accepted;
+        in_flight_ += accepted;
+        in_flight_ -= reap(completions);
+    }
+}
+
+void metrics::IoUring::abandon(std::vector<IoCompletion> &completions
+) noexcept {
+    Rings &r = *rings_;
+    prepared_ = 0;
+    while (in_flight_ > 0) {
+        if (io_uring_enter(r.fd, 0, in_flight_, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            // Cannot wait in the kernel; the requests still complete, so
+            // poll the completion queue.
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        in_flight_ -= reap(completions);
+    }
+}
+
+unsigned metrics::IoUring::reap(std::vector<IoCompletion> &completions
+) noexcept {
+    Rings &r = *rings_;
+    const unsigned mask = r.params.cq_entries - 1;
+    const unsigned first = r.cq_head().load(std::memory_order_relaxed);
+    const unsigned tail = r.cq_tail().load(std::memory_order_acquire);
+    for (unsigned head = first; head != tail; ++head) {
+        const io_uring_cqe &cqe = r.cqes()[head & mask];
+        completions.push_back({cqe.user_data, cqe.res});
+    }
+    r.cq_head().store(tail, std::memory_order_release);
+    return tail - first;
+}
+
+#else
+
+struct metrics::IoUring::Rings {};
+
+metrics::IoUring::IoUring(unsigned) : prepared_(0), in_flight_(0) {
+    throw std::system_error(ENOSYS, std::generic_category(), "io_uring");
+}
+
+metrics::IoUring::~IoUring() = default;
+
+unsigned metrics::IoUring::free_entries() const noexcept {
+    return 0;
+}
+
+void metrics::IoUring::writev(int, const iovec *, unsigned, uint64_t, bool)
+    noexcept {
+}
+
+void metrics::IoUring::fdatasync(int, uint64_t, bool) noexcept {
+}
+
+void metrics::IoUring::submit(std::vector<IoCompletion> &) {
+}
+
+void metrics::IoUring::abandon(std::vector<IoCompletion> &) noexcept {
+}
+
+unsigned metrics::IoUring::reap(std::vector<IoCompletion> &) noexcept {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "meter.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "openmetrics.hpp"
+
+namespace {
+
+constexpr int64_t tick_nanos =
+    std::chrono::nanoseconds(metrics::Meter::tick_interval).count();
+constexpr double window_seconds[] = {60.0, 300.0, 900.0};
+constexpr std::string_view rate_suffixes[] = {
+    "_m1_rate", "_m5_rate", "_m15_rate"
+};
+
+int64_t now_nanos() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+}  // namespace
+
+void metrics::Meter::start() noexcept {
+    const int64_t now = now_nanos();
+    started_.store(now, std::memory_order_relaxed);
+    last_tick_.store(now, std::memory_order_relaxed);
+}
+
+void metrics::Meter::advance(int64_t now) const noexcept {
+    if (now - last_tick_.load(std::memory_order_relaxed) < tick_nanos ||
+        ticking_.exchange(true, std::memory_order_acquire)) {
+        return;
+    }
+    // Another reader may have advanced past now in the meantime.
+    const int64_t last = last_tick_.load(std::memory_order_relaxed);
+    const int64_t ticks = (now - last) / tick_nanos;
+    if (ticks > 0) {
+        last_tick_.store(last + ticks * tick_nanos, std::memory_order_relaxed);
+        const uint64_t count = count_.load(std::memory_order_relaxed);
+        const double elapsed = static_cast<double>(ticks * tick_nanos) * 1e-9;
+        const double rate = static_cast<double>(count - counted_) / elapsed;
+        counted_ = count;
+        for (int w = 0; w < windows; ++w) {
+            // One tick keeps exp(-interval / window) of the old average, so
+            // a constant rate over several ticks keeps that to their power.
+            // The first tick starts the averages at the observed rate.
+            const double keep = std::exp(-elapsed / window_seconds[w]);
+            const double previous = rates_[w].load(std::memory_order_relaxed);
+            rates_[w].store(
+                primed_ ? rate + (previous - rate) * keep : rate,
+                std::memory_order_relaxed
+            );
+        }
+        primed_ = true;
+    }
+    ticking_.store(false, std::memory_order_release);
+}
+
+void metrics::Meter::tick() const noexcept {
+    advance(now_nanos());
+}
+
+uint64_t metrics::Meter::count() const noexcept {
+    return count_.load(std::memory_order_relaxed);
+}
+
+metrics::Meter::Rates metrics::Meter::rates() const noexcept {
+    const int64_t now = now_nanos();
+    advance(now);
+    Rates rates{
+        count_.load(std::memory_order_relaxed),
+        rates_[0].load(std::memory_order_relaxed),
+        rates_[1].load(std::memory_order_relaxed),
+        rates_[2].load(std::memory_order_relaxed),
+        0.0
+    };
+    const int64_t alive = now - started_.load(std::memory_order_relaxed);
+    if (alive > 0) {
+        rates.mean = static_cast<double>(rates.count) /
+                     (static_cast<double>(alive) * 1e-9);
+    }
+    return rates;
+}
+
+std::string_view metrics::Meter::name() const noexcept {
+    return name_;
+}
+
+void metrics::Meter::append_to(std::string &out) const {
+    const Rates rates = this->rates();
+    const double values[] = {rates.m1, rates.m5, rates.m15};
+
+    out += "{\"";
+    out += name_;
+    out += "_count\" ";
+    append_number(out, rates.count);
+    for (int w = 0; w < windows; ++w) {
+        out += " \"";
+        out += name_;
+        out += rate_suffixes[w];
+        out += "\" ";
+        append_number(out, values[w]);
+    }
+    out += " \"";
+    out += name_;
+    out += "_mean_rate\" ";
+    append_number(out, rates.mean);
+    out += '}';
+}
+
+std::string_view metrics::Meter::openmetrics_type() const noexcept {
+    return {};
+}
+
+void metrics::Meter::append_openmetrics_samples(std::string &out) const {
+    const Rates rates = this->rates();
+    const auto name = split_metric_name(name_);
+    append_type_line(out, name.family, "counter");
+    append_value_sample(out, name, "_total", rates.count);
+
+    auto append_gauge = [&](std::string_view suffix, double value) {
+        std::string family(name.family);
+        family += suffix;
+        append_type_line(out, family, "gauge");
+        append_value_sample(out, {family, name.labels}, {}, value);
+    };
+    const double values[] = {rates.m1, rates.m5, rates.m15};
+    for (int w = 0; w < windows; ++w) {
+        append_gauge(rate_suffixes[w], values[w]);
+    }
+    append_gauge("_mean_rate", rates.mean);
+}
+
+void metrics::Meter::reset() noexcept {
+    while (ticking_.exchange(true, std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    count_.store(0, std::memory_order_relaxed);
+    counted_ = 0;
+    primed_ = false;
+    for (auto &rate : rates_) {
+        rate.store(0.0, std::memory_order_relaxed);
+    }
+    start();
+    ticking_.store(false, std::memory_order_release);
+}
+
+void metrics::Meter::collect_and_reset(std::string &out) {
+    append_to(out);
+}
@@ -0,0 +1,297 @@
+#include "native_histogram.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "openmetrics.hpp"
+
+metrics::NativeHistogram::~NativeHistogram() {
+    for (auto *directory : {&positive_, &negative_}) {
+        for (auto &chunk : *directory) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+std::size_t metrics::NativeHistogram::chunk_length() const noexcept {
+    return static_cast<std::size_t>(octaves_per_chunk) << schema_;
+}
+
+void metrics::NativeHistogram::increment(
+    Directory &directory,
+    std::size_t slot
+) noexcept {
+    const std::size_t length = chunk_length();
+    auto &entry = directory[slot / length];
+    Chunk *chunk = entry.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        Chunk *fresh = new (std::nothrow) Chunk[length]();
+        if (fresh == nullptr) {
+            return;
+        }
+        if (entry.compare_exchange_strong(
+                chunk, fresh, std::memory_order_acq_rel,
+                std::memory_order_acquire
+            )) {
+            chunk = fresh;
+        } else {
+            delete[] fresh;
+        }
+    }
+    chunk[slot % length].fetch_add(1, std::memory_order_relaxed);
+}
+
+void metrics::NativeHistogram::observe(double value) noexcept {
+    if (std::isnan(value)) {
+        return;
+    }
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    const double magnitude = std::abs(value);
+    if (magnitude <= std::ldexp(1.0, -octave_limit)) {
+        zero_count_.fetch_add(1, std::memory_order_relaxed);
+        changed_.mark();
+        return;
+    }
+
+    // Bucket i covers (base^(i-1), base^i] with base = 2^(2^-schema).
+    const long per_octave = 1L << schema_;
+    const long limit = octave_limit * per_octave;
+    const double scaled = std::ldexp(std::log2(magnitude), schema_);
+    if (scaled > static_cast<double>(limit)) {
+        (value > 0.0 ? overflow_count_ : underflow_count_)
+            .fetch_add(1, std::memory_order_relaxed);
+        changed_.mark();
+        return;
+    }
+    // Magnitudes above the zero threshold give at least 1 - limit.
+    const auto index = static_cast<long>(
+        std::max(std::ceil(scaled), static_cast<double>(1 - limit))
+    );
+    const auto slot = static_cast<std::size_t>(index + limit - 1);
+    increment(value > 0.0 ? positive_ : negative_, slot);
+    changed_.mark();
+}
+
+void metrics::NativeHistogram::collect(
+    const Directory &directory,
+    bool negative,
+    bool clear,
+    Snapshot &out
+) const {
+    const std::size_t length = chunk_length();
+    const long per_octave = 1L << schema_;
+    const long limit = octave_limit * per_octave;
+    const double step = std::ldexp(1.0, -schema_);
+
+    auto visit = [&](std::size_t c, std::size_t offset) {
+        Chunk *chunk = directory[c].load(std::memory_order_acquire);
+        if (chunk == nullptr) {
+            return;
+        }
+        const uint64_t count =
+            clear ? chunk[offset].exchange(0, std::memory_order_relaxed)
+                  : chunk[offset].load(std::memory_order_relaxed);
+        if (count == 0) {
+            return;
+        }
+        const long index = static_cast<long>(c * length + offset) - limit + 1;
+        const double upper = std::exp2(static_cast<double>(index) * step);
+        const double lower = std::exp2(static_cast<double>(index - 1) * step);
+        if (negative) {
+            out.buckets.push_back({-upper, -lower, count});
+        } else {
+            out.buckets.push_back({lower, upper, count});
+        }
+    };
+
+    if (negative) {
+        for (std::size_t c = directory.size(); c-- > 0;) {
+            if (directory[c].load(std::memory_order_acquire) == nullptr) {
+                continue;
+            }
+            for (std::size_t offset = length; offset-- > 0;) {
+                visit(c, offset);
+            }
+        }
+    } else {
+        for (std::size_t c = 0; c < directory.size(); ++c) {
+            if (directory[c].load(std::memory_order_acquire) == nullptr) {
+                continue;
+            }
+            for (std::size_t offset = 0; offset < length; ++offset) {
+                visit(c, offset);
+            }
+        }
+    }
+}
+
+metrics::NativeHistogram::Snapshot metrics::NativeHistogram::get() const {
+    return read(false);
+}
+
+metrics::NativeHistogram::Snapshot metrics::NativeHistogram::read(bool clear
+) const {
+    Snapshot snapshot{0.0, 0, schema_, {}, {}, 0};
+    const auto take = [clear](std::atomic<uint64_t> &counter) {
+        return clear ? counter.exchange(0, std::memory_order_relaxed)
+                     : counter.load(std::memory_order_relaxed);
+    };
+    const double limit = std::ldexp(1.0, octave_limit);
+    if (const uint64_t underflow = take(underflow_count_)) {
+        snapshot.buckets.push_back(
+            {-std::numeric_limits<double>::infinity(), -limit, underflow}
+        );
+    }
+    collect(negative_, true, clear, snapshot);
+    const uint64_t zero = take(zero_count_);
+    if (zero > 0) {
+        const double threshold = std::ldexp(1.0, -octave_limit);
+        snapshot.buckets.push_back({-threshold, threshold, zero});
+    }
+    collect(positive_, false, clear, snapshot);
+
+    snapshot.cumulative.reserve(snapshot.buckets.size());
+    for (const auto &bucket : snapshot.buckets) {
+        snapshot.count += bucket.count;
+        snapshot.cumulative.push_back(snapshot.count);
+    }
+    snapshot.overflow = take(overflow_count_);
+    snapshot.count += snapshot.overflow;
+    snapshot.sum = clear ? sum_.exchange(0.0, std::memory_order_relaxed)
+                         : sum_.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+double metrics::NativeHistogram::Snapshot::quantile(double q) const noexcept {
+    if (count == 0 || std::isnan(q)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    const double rank =
+        std::clamp(q, 0.0, 1.0) * static_cast<double>(count - 1);
+    auto it = std::upper_bound(
+        cumulative.begin(), cumulative.end(), rank,
+        [](double r, uint64_t c) { return r < static_cast<double>(c); }
+    );
+    if (it == cumulative.end()) {
+        // The rank falls among the overflow observations.
+        return std::numeric_limits<double>::infinity();
+    }
+    const Bucket &bucket = buckets[std::distance(cumulative.begin(), it)];
+    if (bucket.lower < 0.0 && bucket.upper > 0.0) {
+        return 0.0;
+    }
+    if (std::isinf(bucket.lower)) {
+        return bucket.upper;
+    }
+    // The harmonic mean of the bounds keeps the relative error of the
+    // estimate symmetric across the bucket.
+    return 2.0 * bucket.lower * bucket.upper / (bucket.lower + bucket.upper);
+}
+
+int metrics::NativeHistogram::schema() const noexcept {
+    return schema_;
+}
+
+double metrics::NativeHistogram::relative_error() const noexcept {
+    const double base = std::exp2(std::ldexp(1.0, -schema_));
+    return (base - 1.0) / (base + 1.0);
+}
+
+std::string_view metrics::NativeHistogram::name() const noexcept {
+    return name_;
+}
+
+void metrics::NativeHistogram::append_to(std::string &out) const {
+    append_snapshot(out, get());
+}
+
+void metrics::NativeHistogram::append_snapshot(
+    std::string &out,
+    const Snapshot &snapshot
+) const {
+    out += '{';
+    for (std::size_t i = 0; i < snapshot.buckets.size(); ++i) {
+        out += "\"";
+        out += name_;
+        out += "_bucket{le=";
+        append_number(out, snapshot.buckets[i].upper);
+        out += "}\" ";
+        append_number(out, snapshot.cumulative[i]);
+        out += " ";
+    }
+    out += "\"";
+    out += name_;
+    out += "_bucket{le=+Inf}\" ";
+    append_number(out, snapshot.count);
+    out += " ";
+
+    out += " \"";
+    out += name_;
+    out += "_sum\" ";
+    append_number(out, snapshot.sum);
+    out += " ";
+
+    out += " \"";
+    out += name_;
+    out += "_count\" ";
+    append_number(out, snapshot.count);
+    out += "}";
+}
+
+std::string_view metrics::NativeHistogram::openmetrics_type() const noexcept {
+    return "histogram";
+}
+
+void metrics::NativeHistogram::append_openmetrics_samples(std::string &out
+) const {
+    const Snapshot snapshot = get();
+    const auto name = split_metric_name(name_);
+    for (std::size_t i = 0; i < snapshot.buckets.size(); ++i) {
+        append_bucket_sample(
+            out, name, snapshot.buckets[i].upper, snapshot.cumulative[i]
+        );
+    }
+    append_bucket_sample(
+        out, name, std::numeric_limits<double>::infinity(), snapshot.count
+    );
+    append_value_sample(out, name, "_sum", snapshot.sum);
+    append_value_sample(out, name, "_count", snapshot.count);
+}
+
+void metrics::NativeHistogram::reset() noexcept {
+    const std::size_t length = chunk_length();
+    uint64_t cleared = zero_count_.exchange(0, std::memory_order_relaxed) +
+                       overflow_count_.exchange(0, std::memory_order_relaxed) +
+                       underflow_count_.exchange(0, std::memory_order_relaxed);
+    for (auto *directory : {&positive_, &negative_}) {
+        for (auto &entry : *directory) {
+            Chunk *chunk = entry.load(std::memory_order_acquire);
+            if (chunk == nullptr) {
+                continue;
+            }
+            for (std::size_t i = 0; i < length; ++i) {
+                cleared += chunk[i].exchange(0, std::memory_order_relaxed);
+            }
+        }
+    }
+    sum_.store(0.0, std::memory_order_relaxed);
+    if (cleared > 0) {
+        changed_.mark();
+    }
+}
+
+void metrics::NativeHistogram::collect_and_reset(std::string &out) {
+    const Snapshot snapshot = read(true);
+    if (snapshot.count > 0) {
+        changed_.mark();
+    }
+    append_snapshot(out, snapshot);
+}
+
+bool metrics::NativeHistogram::consume_changed() noexcept {
+    return changed_.consume();
+}
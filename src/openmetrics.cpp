@@ -0,0 +1,10 @@
+#include "openmetrics.hpp"
+#include <string>
+#include "metric.hpp"
+
+void metrics::Metric::append_openmetrics_samples(std::string &out) const {
+    const auto name = split_metric_name(this->name());
+    append_sample_name(out, name.family, {}, name.labels);
+    append_to(out);
+    out += '\n';
+}
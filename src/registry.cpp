@@ -0,0 +1,160 @@
+#include "registry.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+void metrics::MetricRegistry::add(std::shared_ptr<Metric> metric) {
+    insert(std::move(metric), false);
+}
+
+void metrics::MetricRegistry::add_weak(const std::shared_ptr<Metric> &metric
+) {
+    insert(metric, true);
+}
+
+void metrics::MetricRegistry::insert(
+    std::shared_ptr<Metric> metric,
+    bool weak
+) {
+    if (!metric) {
+        throw std::invalid_argument("metric is null");
+    }
+    const std::string_view name = metric->name();
+    if (auto found = index_.find(name); found != index_.end()) {
+        Entry &entry = entries_[found->second];
+        const auto alive = entry.owner ? entry.owner : entry.watched.lock();
+        if (alive == metric) {
+            if (!weak && !entry.owner) {
+                entry.scalar = metric->scalar_slot();
+                entry.owner = std::move(metric);
+                entry.watched.reset();
+                columns_stale_ |= entry.scalar.type != ScalarType::None;
+            }
+            return;
+        }
+        if (alive) {
+            throw std::invalid_argument(
+                "metric already registered: " + std::string(name)
+            );
+        }
+        drop(entry);
+    }
+
+    Entry &entry =
+        entries_.emplace_back(Entry{metric.get(), {}, {}, {}, ScalarSlot{}});
+    try {
+        entry.name =
+            index_.emplace(std::string(name), entries_.size() - 1).first->first;
+    } catch (...) {
+        entries_.pop_back();
+        throw;
+    }
+    if (weak) {
+        entry.watched = metric;
+    } else {
+        entry.scalar = metric->scalar_slot();
+        entry.owner = std::move(metric);
+        columns_stale_ |= entry.scalar.type != ScalarType::None;
+    }
+}
+
+bool metrics::MetricRegistry::remove(std::string_view name) {
+    const auto found = index_.find(name);
+    if (found == index_.end()) {
+        return false;
+    }
+    Entry &entry = entries_[found->second];
+    const bool live = entry.owner || !entry.watched.expired();
+    drop(entry);
+    return live;
+}
+
+std::shared_ptr<metrics::Metric>
+metrics::MetricRegistry::find(std::string_view name) const {
+    const auto found = index_.find(name);
+    if (found == index_.end()) {
+        return nullptr;
+    }
+    const Entry &entry = entries_[found->second];
+    return entry.owner ? entry.owner : entry.watched.lock();
+}
+
+std::size_t metrics::MetricRegistry::size() const noexcept {
+    return entries_.size() - holes_;
+}
+
+void metrics::MetricRegistry::drop(Entry &entry) noexcept {
+    index_.erase(index_.find(entry.name));
+    columns_stale_ |= entry.scalar.type != ScalarType::None;
+    entry.metric = nullptr;
+    entry.scalar = {};
+    entry.owner.reset();
+    entry.watched.reset();
+    entry.name = {};
+    ++holes_;
+}
+
+void metrics::MetricRegistry::compact() {
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].metric == nullptr) {
+            continue;
+        }
+        if (kept != i) {
+            entries_[kept] = std::move(entries_[i]);
+            index_.find(entries_[kept].name)->second = kept;
+        }
+        ++kept;
+    }
+    entries_.erase(entries_.begin() + kept, entries_.end());
+    holes_ = 0;
+}
+
+namespace {
+
+template <typename N>
+void add_to_column(
+    metrics::ScalarColumn<N> &column,
+    const metrics::ScalarSlot &slot,
+    std::string_view name
+) {
+    column.values.push_back(static_cast<std::atomic<N> *>(slot.value));
+    column.changed.push_back(slot.changed);
+    column.labels += " \"";
+    column.labels += name;
+    column.labels += "\" ";
+    column.label_ends.push_back(column.labels.size());
+}
+
+}  // namespace
+
+metrics::ScalarColumns &metrics::MetricRegistry::scalar_columns() {
+    if (!columns_stale_) {
+        return columns_;
+    }
+    columns_.unsigned_values.clear();
+    columns_.signed_values.clear();
+    columns_.double_values.clear();
+    for (const auto &entry : entries_) {
+        const ScalarSlot &slot = entry.scalar;
+        switch (slot.type) {
+            case ScalarType::Unsigned:
+                add_to_column(columns_.unsigned_values, slot, entry.name);
+                break;
+            case ScalarType::Signed:
+                add_to_column(columns_.signed_values, slot, entry.name);
+                break;
+            case ScalarType::Double:
+                add_to_column(columns_.double_values, slot, entry.name);
+                break;
+            default:
+                break;
+        }
+    }
+    columns_stale_ = false;
+    return columns_;
+}
@@ -0,0 +1,289 @@
+#include "ring_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t sequence;
+};
+
+Header &header_of(void *mapping) noexcept {
+    return *static_cast<Header *>(mapping);
+}
+
+constexpr char magic[8] = {'m', 'e', 't', 'r', 'i', 'n', 'g', '\x01'};
+constexpr uint32_t version = 1;
+
+// Record header: u32 length, u32 crc32, u64 sequence.
+constexpr uint64_t record_header = 16;
+// Length of a record that only fills the rest of the data area.
+constexpr uint32_t wrap_marker = 0xffffffff;
+
+constexpr uint64_t align(uint64_t size) noexcept {
+    return (size + 7) & ~uint64_t{7};
+}
+
+constexpr std::array<uint32_t, 256> crc_table() noexcept {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+constexpr auto crc_lookup = crc_table();
+
+uint32_t crc32(uint32_t crc, const char *bytes, std::size_t size) noexcept {
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = crc_lookup[(crc ^ static_cast<uint8_t>(bytes[i])) & 0xff] ^
+              (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t record_checksum(uint64_t sequence, std::string_view payload) noexcept {
+    char sequence_bytes[8];
+    std::memcpy(sequence_bytes, &sequence, sizeof(sequence));
+    return crc32(
+        crc32(0, sequence_bytes, sizeof(sequence_bytes)), payload.data(),
+        payload.size()
+    );
+}
+
+uint32_t load_u32(const char *at) noexcept {
+    uint32_t value;
+    std::memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+uint64_t load_u64(const char *at) noexcept {
+    uint64_t value;
+    std::memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+// Position of the record that follows the one at position.
+uint64_t next_record(const char *data, uint64_t capacity, uint64_t position) {
+    const uint64_t offset = position % capacity;
+    const uint32_t length = load_u32(data + offset);
+    if (length == wrap_marker) {
+        return position + (capacity - offset);
+    }
+    return position + align(record_header + length);
+}
+
+}  // namespace
+
+metrics::RingFile::RingFile(const std::string &path, std::size_t capacity)
+    : capacity_(std::max<std::size_t>(align(capacity), 64)),
+      mapping_size_(header_size + capacity_),
+      mapping_(nullptr) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 ||
+        (static_cast<std::size_t>(info.st_size) != mapping_size_ &&
+         ::ftruncate(fd, static_cast<off_t>(mapping_size_)) != 0)) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    void *mapping = ::mmap(
+        nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+    const int error = errno;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    mapping_ = mapping;
+
+    const Header &h = header_of(mapping_);
+    const bool valid =
+        std::memcmp(h.magic, magic, sizeof(magic)) == 0 &&
+        h.version == version && h.header_size == header_size &&
+        h.capacity == capacity_ && h.tail <= h.head &&
+        h.head - h.tail <= capacity_ && h.head % 8 == 0 && h.tail % 8 == 0;
+    if (!valid) {
+        initialise();
+    }
+}
+
+metrics::RingFile::~RingFile() {
+    ::munmap(mapping_, mapping_size_);
+}
+
+char *metrics::RingFile::data() const noexcept {
+    return static_cast<char *>(mapping_) + header_size;
+}
+
+void metrics::RingFile::initialise() noexcept {
+    Header &h = header_of(mapping_);
+    std::memset(&h, 0, sizeof(h));
+    h.version = version;
+    h.header_size = header_size;
+    h.capacity = capacity_;
+    // The magic goes last so that a half-written header is rejected.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(h.magic, magic, sizeof(magic));
+}
+
+bool metrics::RingFile::append(std::string_view record) {
+    const uint64_t size = align(record_header + record.size());
+    if (size > capacity_ || record.size() >= wrap_marker) {
+        return false;
+    }
+
+    std::unique_lock lock(mutex_);
+    Header &h = header_of(mapping_);
+    std::atomic_ref head(h.head);
+    std::atomic_ref tail(h.tail);
+    std::atomic_ref sequence(h.sequence);
+    char *const bytes = data();
+
+    const uint64_t position = head.load(std::memory_order_relaxed);
+    const uint64_t offset = position % capacity_;
+    uint64_t start = position;
+    if (capacity_ - offset < size) {
+        start += capacity_ - offset;
+    }
+    const uint64_t end = start + size;
+
+    // Drop the oldest records until the new one fits, and publish the tail
+    // before their space is overwritten.
+    uint64_t oldest = tail.load(std::memory_order_relaxed);
+    while (end - oldest > capacity_ && oldest < position) {
+        oldest = next_record(bytes, capacity_, oldest);
+    }
+    if (end - oldest > capacity_) {
+        oldest = start;
+    }
+    tail.store(oldest, std::memory_order_release);
+
+    if (start != position) {
+        std::memcpy(bytes + offset, &wrap_marker, sizeof(wrap_marker));
+    }
+    char *const at = bytes + start % capacity_;
+    const uint64_t number = sequence.load(std::memory_order_relaxed);
+    const auto length = static_cast<uint32_t>(record.size());
+    const uint32_t checksum = record_checksum(number, record);
+    std::memcpy(at, &length, sizeof(length));
+    std::memcpy(at + 4, &checksum, sizeof(checksum));
+    std::memcpy(at + 8, &number, sizeof(number));
+    std::memcpy(at + record_header, record.data(), record.size());
+    std::memset(
+        at + record_header + record.size(), 0,
+        size - record_header - record.size()
+    );
+
+    sequence.store(number + 1, std::memory_order_relaxed);
+    head.store(end, std::memory_order_release);
+    return true;
+}
+
+void metrics::RingFile::sync() {
+    std::unique_lock lock(mutex_);
+    ::msync(mapping_, mapping_size_, MS_SYNC);
+}
+
+std::size_t metrics::RingFile::capacity() const noexcept {
+    return capacity_;
+}
+
+std::vector<metrics::RingRecord>
+metrics::read_ring_file(const std::string &path, std::size_t max_records) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    std::string file;
+    char chunk[1 << 16];
+    while (true) {
+        ssize_t got = ::read(fd, chunk, sizeof(chunk));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        if (got == 0) {
+            break;
+        }
+        file.append(chunk, static_cast<std::size_t>(got));
+    }
+    ::close(fd);
+
+    Header h;
+    if (file.size() < RingFile::header_size) {
+        throw std::runtime_error(path + ": not a metrics ring file");
+    }
+    std::memcpy(&h, file.data(), sizeof(h));
+    if (std::memcmp(h.magic, magic, sizeof(magic)) != 0 ||
+        h.version != version || h.header_size != RingFile::header_size ||
+        h.capacity < 64 || h.capacity % 8 != 0 ||
+        file.size() - RingFile::header_size < h.capacity ||
+        h.tail > h.head || h.head - h.tail > h.capacity) {
+        throw std::runtime_error(path + ": not a metrics ring file");
+    }
+
+    const char *bytes = file.data() + RingFile::header_size;
+    const uint64_t capacity = h.capacity;
+    std::vector<RingRecord> records;
+    for (uint64_t position = h.tail; position < h.head;) {
+        const uint64_t offset = position % capacity;
+        const uint32_t length = load_u32(bytes + offset);
+        if (length == wrap_marker) {
+            position += capacity - offset;
+            continue;
+        }
+        if (capacity - offset < record_header ||
+            capacity - offset - record_header < length) {
+            break;
+        }
+        const std::string_view payload(bytes + offset + record_header, length);
+        const uint64_t sequence = load_u64(bytes + offset + 8);
+        if (load_u32(bytes + offset + 4) !=
+            record_checksum(sequence, payload)) {
+            break;
+        }
+        records.push_back({sequence, std::string(payload)});
+        position += align(record_header + length);
+    }
+
+    if (records.size() > max_records) {
+        records.erase(
+            records.begin(),
+            records.end() - static_cast<std::ptrdiff_t>(max_records)
+        );
+    }
+    return records;
+}
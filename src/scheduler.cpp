@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "binary_format.hpp"
+#include "collector.hpp"
+#include "ring_file.hpp"
+
+namespace {
+
+using Clock = std::chrono::system_clock;
+
+// First multiple of interval since the epoch that is strictly after now.
+Clock::time_point next_boundary(
+    Clock::time_point now,
+    std::chrono::milliseconds interval
+) {
+    const auto since_epoch = now.time_since_epoch();
+    const auto ticks = since_epoch / interval + 1;
+    return Clock::time_point(
+        std::chrono::duration_cast<Clock::duration>(interval * ticks)
+    );
+}
+
+}  // namespace
+
+std::size_t metrics::MetricsCollector::add_sink(
+    std::string filename,
+    SinkOptions options
+) {
+    options.interval = std::max(options.interval, std::chrono::milliseconds{1});
+    const auto &file = options.file;
+    const bool file_options = file.max_size > 0 || file.max_age.count() > 0 ||
+                              file.compression != Compression::None;
+    const bool rotated = file.max_size > 0 || file.max_age.count() > 0;
+    if (options.encoding == Encoding::Binary && rotated) {
+        throw std::invalid_argument("binary sinks cannot be rotated");
+    }
+    std::shared_ptr<RingFile> ring;
+    if (options.ring_size > 0) {
+        if (options.encoding != Encoding::Text) {
+            throw std::invalid_argument("ring sinks only support text lines");
+        }
+        if (file_options) {
+            throw std::invalid_argument(
+                "ring sinks cannot be rotated or compressed"
+            );
+        }
+        ring = std::make_shared<RingFile>(filename, options.ring_size);
+    } else if (file_options) {
+        set_file_options(filename, file);
+    }
+    std::size_t id;
+    {
+        std::unique_lock lock(scheduler_mutex_);
+        if (expositions_.load(std::memory_order_relaxed) > 0) {
+            throw std::logic_error("an exposed collector cannot have sinks");
+        }
+        if (options.encoding == Encoding::Binary) {
+            std::unique_lock options_lock(file_options_mutex_);
+            auto it = file_options_.find(filename);
+            if (it != file_options_.end() &&
+                (it->second.max_size > 0 || it->second.max_age.count() > 0)) {
+                throw std::invalid_argument("binary sinks cannot be rotated");
+            }
+        }
+        id = next_sink_id_++;
+        Sink sink;
+        sink.id = id;
+        sink.filename = std::move(filename);
+        sink.options = options;
+        sink.next_due = next_boundary(Clock::now(), options.interval);
+        if (options.encoding == Encoding::Binary) {
+            sink.encoder = std::make_shared<BinaryEncoder>();
+            sink.generation = file_generation_.load(std::memory_order_acquire);
+        }
+        sink.ring = std::move(ring);
+        sinks_.push_back(std::move(sink));
+        if (!scheduler_.joinable()) {
+            scheduler_ = std::thread(&MetricsCollector::schedule, this);
+        }
+    }
+    scheduler_cv_.notify_one();
+    return id;
+}
+
+// Expects scheduler_mutex_ to be held.
+bool metrics::MetricsCollector::writes_binary(const std::string &filename
+) const {
+    return std::any_of(sinks_.begin(), sinks_.end(), [&](const Sink &s) {
+        return s.filename == filename && s.options.encoding == Encoding::Binary;
+    });
+}
+
+bool metrics::MetricsCollector::remove_sink(std::size_t id) {
+    std::unique_lock lock(scheduler_mutex_);
+    auto it = std::find_if(sinks_.begin(), sinks_.end(), [id](const Sink &s) {
+        return s.id == id;
+    });
+    if (it == sinks_.end()) {
+        return false;
+    }
+    sinks_.erase(it);
+    return true;
+}
+
+void metrics::MetricsCollector::attach_exposition() {
+    std::unique_lock lock(scheduler_mutex_);
+    if (!sinks_.empty()) {
+        throw std::logic_error("a collector with sinks cannot be exposed");
+    }
+    expositions_.fetch_add(1, std::memory_order_release);
+}
+
+void metrics::MetricsCollector::detach_exposition() noexcept {
+    std::unique_lock lock(scheduler_mutex_);
+    expositions_.fetch_sub(1, std::memory_order_release);
+}
+
+std::vector<metrics::SinkStats> metrics::MetricsCollector::sink_stats() const {
+    std::unique_lock lock(scheduler_mutex_);
+    std::vector<SinkStats> stats;
+    stats.reserve(sinks_.size());
+    for (const auto &sink : sinks_) {
+        stats.push_back(
+            {sink.id, sink.filename, sink.options.interval, sink.flushes,
+             sink.last_duration, sink.max_duration}
+        );
+    }
+    return stats;
+}
+
+void metrics::MetricsCollector::schedule() {
+    std::unique_lock lock(scheduler_mutex_);
+    while (!scheduler_stopped_) {
+        auto wake = Clock::time_point::max();
+        for (const auto &sink : sinks_) {
+            wake = std::min(wake, sink.next_due);
+        }
+        if (wake == Clock::time_point::max()) {
+            scheduler_cv_.wait(lock);
+            continue;
+        }
+        scheduler_cv_.wait_until(lock, wake);
+        if (scheduler_stopped_) {
+            break;
+        }
+
+        lock.unlock();
+        run_due_sinks(Clock::now());
+        lock.lock();
+    }
+}
+
+void metrics::MetricsCollector::run_due_sinks(Clock::time_point now) {
+    struct Due {
+        std::size_t id;
+        std::string filename;
+        TimestampFormat format;
+        std::shared_ptr<BinaryEncoder> encoder;
+        std::shared_ptr<RingFile> ring;
+    };
+
+    const uint64_t generation =
+        file_generation_.load(std::memory_order_acquire);
+    std::vector<Due> due;
+    {
+        std::unique_lock lock(scheduler_mutex_);
+        for (auto &sink : sinks_) {
+            if (sink.next_due > now) {
+                continue;
+            }
+            // A reopened file starts empty and needs a fresh dictionary.
+            if (sink.encoder && sink.generation != generation) {
+                sink.encoder->reset();
+                sink.generation = generation;
+            }
+            due.push_back(
+                {sink.id, sink.filename, sink.options.timestamp, sink.encoder,
+                 sink.ring}
+            );
+            sink.next_due = next_boundary(now, sink.options.interval);
+        }
+    }
+    if (due.empty()) {
+        return;
+    }
+
+    const auto started = std::chrono::steady_clock::now();
+
+    // Binary sinks need to know where the values are and of which type.
+    const bool binary = std::any_of(due.begin(), due.end(), [](auto &d) {
+        return d.encoder != nullptr;
+    });
+    std::string body;
+    {
+        std::unique_lock lock(mutex_);
+        if (binary) {
+            RecordValues record(scheduler_values_, body);
+            append_metrics(body);
+        } else {
+            append_metrics(body);
+        }
+    }
+    observe_flush(started);
+
+    // Binary sinks keep per-file encoder state. Text sinks get one line per
+    // distinct timestamp format, copied to every sink using it.
+    std::stable_sort(due.begin(), due.end(), [](const Due &a, const Due &b) {
+        return a.format < b.format;
+    });
+    for (auto &sink : due) {
+        if (sink.encoder) {
+            std::string frames = take_buffer();
+            sink.encoder->encode(frames, now, body, scheduler_values_.values);
+            enqueue(std::move(sink.filename), std::move(frames));
+        }
+    }
+    std::vector<std::size_t> flushed;
+    for (const auto &sink : due) {
+        flushed.push_back(sink.id);
+    }
+    std::erase_if(due, [](const Due &d) { return d.encoder != nullptr; });
+    body += '\n';
+
+    for (std::size_t first = 0; first < due.size();) {
+        std::size_t last = first;
+        while (last < due.size() && due[last].format == due[first].format) {
+            ++last;
+        }
+
+        std::string line = take_buffer();
+        scheduler_timestamp_.set_format(due[first].format);
+        scheduler_timestamp_.append_to(line, now);
+        line += body;
+        for (std::size_t i = first; i + 1 < last; ++i) {
+            if (due[i].ring) {
+                append_to_ring(due[i].filename, *due[i].ring, line);
+            } else {
+                enqueue(std::move(due[i].filename), line);
+            }
+        }
+        if (due[last - 1].ring) {
+            append_to_ring(due[last - 1].filename, *due[last - 1].ring, line);
+        } else {
+            enqueue(std::move(due[last - 1].filename), std::move(line));
+        }
+        first = last;
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - started;
+    std::unique_lock lock(scheduler_mutex_);
+    for (auto &sink : sinks_) {
+        if (std::find(flushed.begin(), flushed.end(), sink.id) !=
+            flushed.end()) {
+            ++sink.flushes;
+            sink.last_duration = elapsed;
+            sink.max_duration = std::max(sink.max_duration, sink.last_duration);
+        }
+    }
+}
+
+void metrics::MetricsCollector::append_to_ring(
+    const std::string &filename,
+    RingFile &ring,
+    const std::string &line
+) {
+    const bool appended = ring.append(line);
+    auto *self = self_metrics_.load(std::memory_order_acquire);
+    if (!self) {
+        return;
+    }
+    if (appended) {
+        self->bytes_written->with_labels({filename})->inc_by(line.size());
+    } else {
+        self->write_errors->inc();
+    }
+}
@@ -0,0 +1,332 @@
+#include "shared_memory.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+constexpr char magic[8] = {'m', 'e', 't', 's', 'h', 'm', '\0', '\x01'};
+constexpr uint32_t version = 1;
+
+// Segment header: magic, u32 version, u32 header size, u64 segment size,
+// u64 bytes used, u64 entry count.
+constexpr std::size_t header_size = 64;
+constexpr std::size_t used_offset = 24;
+constexpr std::size_t count_offset = 32;
+
+// Entry header: u32 entry size, u8 type, u8 value type, u16 reserved,
+// u32 name length, u32 bound count. The name follows, padded to 8 bytes,
+// then the bounds and the value slots.
+constexpr std::size_t entry_header = 16;
+
+constexpr std::size_t align(std::size_t size) noexcept {
+    return (size + 7) & ~std::size_t{7};
+}
+
+uint32_t load_u32(const char *at) noexcept {
+    uint32_t value;
+    std::memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+const std::atomic<uint64_t> &atomic_at(const char *at) noexcept {
+    return *reinterpret_cast<const std::atomic<uint64_t> *>(at);
+}
+
+std::size_t slots_offset(const char *entry) noexcept {
+    return entry_header + align(load_u32(entry + 8)) +
+           load_u32(entry + 12) * sizeof(double);
+}
+
+}  // namespace
+
+class metrics::SharedMemoryExporter::Segment {
+public:
+    Segment(std::string name, std::size_t size)
+        : name_(std::move(name)), size_(align(std::max(size, header_size))) {
+        int fd = ::shm_open(
+            name_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644
+        );
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), name_);
+        }
+        if (::ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+            const int error = errno;
+            ::close(fd);
+            ::shm_unlink(name_.c_str());
+            throw std::system_error(error, std::generic_category(), name_);
+        }
+        void *mapping = ::mmap(
+            nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+        );
+        const int error = errno;
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            ::shm_unlink(name_.c_str());
+            throw std::system_error(error, std::generic_category(), name_);
+        }
+        mapping_ = static_cast<char *>(mapping);
+
+        const uint32_t header_bytes = header_size;
+        const uint64_t segment_size = size_;
+        std::memcpy(mapping_ + 8, &version, sizeof(version));
+        std::memcpy(mapping_ + 12, &header_bytes, sizeof(header_bytes));
+        std::memcpy(mapping_ + 16, &segment_size, sizeof(segment_size));
+        new (mapping_ + used_offset) std::atomic<uint64_t>(header_size);
+        new (mapping_ + count_offset) std::atomic<uint64_t>(0);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(mapping_, magic, sizeof(magic));
+    }
+
+    ~Segment() {
+        ::munmap(mapping_, size_);
+        ::shm_unlink(name_.c_str());
+    }
+
+    Segment(const Segment &) = delete;
+    Segment &operator=(const Segment &) = delete;
+
+    void *allocate(
+        SharedMetricType type,
+        SharedValueType value_type,
+        std::string_view name,
+        std::span<const double> bounds,
+        std::size_t slots
+    ) {
+        const std::size_t size = entry_header + align(name.size()) +
+                                 bounds.size() * sizeof(double) +
+                                 slots * sizeof(uint64_t);
+
+        std::unique_lock lock(mutex_);
+        auto &used = *reinterpret_cast<std::atomic<uint64_t> *>(
+            mapping_ + used_offset
+        );
+        auto &count = *reinterpret_cast<std::atomic<uint64_t> *>(
+            mapping_ + count_offset
+        );
+        const uint64_t offset = used.load(std::memory_order_relaxed);
+        if (size > size_ - offset || size > UINT32_MAX) {
+            throw std::length_error(
+                "shared memory segment " + name_ + " is full"
+            );
+        }
+
+        char *entry = mapping_ + offset;
+        const auto entry_size = static_cast<uint32_t>(size);
+        const auto name_length = static_cast<uint32_t>(name.size());
+        const auto bound_count = static_cast<uint32_t>(bounds.size());
+        std::memcpy(entry, &entry_size, sizeof(entry_size));
+        entry[4] = static_cast<char>(type);
+        entry[5] = static_cast<char>(value_type);
+        std::memcpy(entry + 8, &name_length, sizeof(name_length));
+        std::memcpy(entry + 12, &bound_count, sizeof(bound_count));
+        std::memcpy(entry + entry_header, name.data(), name.size());
+        if (!bounds.empty()) {
+            std::memcpy(
+                entry + entry_header + align(name.size()), bounds.data(),
+                bounds.size() * sizeof(double)
+            );
+        }
+
+        // The segment was zero-filled by ftruncate and entries are never
+        // reused, so the slots already read as zero.
+        used.store(offset + size, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_release);
+        return entry + slots_offset(entry);
+    }
+
+    const std::string &name() const noexcept {
+        return name_;
+    }
+
+private:
+    const std::string name_;
+    const std::size_t size_;
+    char *mapping_;
+    std::mutex mutex_;
+};
+
+metrics::SharedMemoryExporter::SharedMemoryExporter(
+    std::string name,
+    std::size_t size
+)
+    : segment_(std::make_shared<Segment>(std::move(name), size)) {
+}
+
+void *metrics::SharedMemoryExporter::allocate(
+    SharedMetricType type,
+    SharedValueType value_type,
+    std::string_view name,
+    std::span<const double> bounds,
+    std::size_t slots
+) {
+    return segment_->allocate(type, value_type, name, bounds, slots);
+}
+
+std::shared_ptr<metrics::Histogram> metrics::SharedMemoryExporter::histogram(
+    std::string name,
+    std::vector<double> buckets
+) {
+    // Counters first, then the sum, all in one entry.
+    auto storage = [&](const std::vector<double> &bounds) {
+        auto *slots = static_cast<char *>(allocate(
+            SharedMetricType::Histogram, SharedValueType::Unsigned, name,
+            bounds, bounds.size() + 1
+        ));
+        auto *counters = reinterpret_cast<std::atomic<uint64_t> *>(slots);
+        for (std::size_t i = 0; i < bounds.size(); ++i) {
+            new (counters + i) std::atomic<uint64_t>(0);
+        }
+        auto *sum = new (slots + bounds.size() * sizeof(uint64_t))
+            std::atomic<double>(0.0);
+        return Histogram::Storage{counters, sum, segment_};
+    };
+    // The factory runs in the constructor body, after the name is copied.
+    return std::make_shared<Histogram>(name, std::move(buckets), storage);
+}
+
+const std::string &metrics::SharedMemoryExporter::name() const noexcept {
+    return segment_->name();
+}
+
+metrics::SharedMetricView::SharedMetricView(const char *entry) noexcept
+    : entry_(entry) {
+}
+
+std::string_view metrics::SharedMetricView::name() const noexcept {
+    return std::string_view(entry_ + entry_header, load_u32(entry_ + 8));
+}
+
+metrics::SharedMetricType metrics::SharedMetricView::type() const noexcept {
+    return static_cast<SharedMetricType>(entry_[4]);
+}
+
+metrics::SharedValueType metrics::SharedMetricView::value_type(
+) const noexcept {
+    return static_cast<SharedValueType>(entry_[5]);
+}
+
+uint64_t metrics::SharedMetricView::slot(std::size_t index) const noexcept {
+    return atomic_at(entry_ + slots_offset(entry_) + index * sizeof(uint64_t))
+        .load(std::memory_order_relaxed);
+}
+
+uint64_t metrics::SharedMetricView::as_unsigned() const noexcept {
+    switch (value_type()) {
+        case SharedValueType::Signed:
+            return static_cast<uint64_t>(as_signed());
+        case SharedValueType::Double:
+            return static_cast<uint64_t>(as_double());
+        default:
+            return slot(0);
+    }
+}
+
+int64_t metrics::SharedMetricView::as_signed() const noexcept {
+    switch (value_type()) {
+        case SharedValueType::Double:
+            return static_cast<int64_t>(as_double());
+        default:
+            return static_cast<int64_t>(slot(0));
+    }
+}
+
+double metrics::SharedMetricView::as_double() const noexcept {
+    switch (value_type()) {
+        case SharedValueType::Signed:
+            return static_cast<double>(static_cast<int64_t>(slot(0)));
+        case SharedValueType::Double:
+            return std::bit_cast<double>(slot(0));
+        default:
+            return static_cast<double>(slot(0));
+    }
+}
+
+std::span<const double> metrics::SharedMetricView::bounds() const noexcept {
+    const auto *first = reinterpret_cast<const double *>(
+        entry_ + entry_header + align(load_u32(entry_ + 8))
+    );
+    return std::span<const double>(first, load_u32(entry_ + 12));
+}
+
+uint64_t metrics::SharedMetricView::bucket_count(std::size_t bucket
+) const noexcept {
+    return slot(bucket);
+}
+
+double metrics::SharedMetricView::sum() const noexcept {
+    return std::bit_cast<double>(slot(load_u32(entry_ + 12)));
+}
+
+metrics::SharedMemoryReader::SharedMemoryReader(const std::string &name)
+    : mapping_(nullptr), size_(0) {
+    int fd = ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), name);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), name);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    if (size_ < header_size) {
+        ::close(fd);
+        throw std::runtime_error(name + ": not a metrics segment");
+    }
+    void *mapping = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    const int error = errno;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::system_error(error, std::generic_category(), name);
+    }
+    mapping_ = static_cast<const char *>(mapping);
+
+    uint32_t segment_version;
+    std::memcpy(&segment_version, mapping_ + 8, sizeof(segment_version));
+    if (std::memcmp(mapping_, magic, sizeof(magic)) != 0 ||
+        segment_version != version) {
+        ::munmap(const_cast<char *>(mapping_), size_);
+        throw std::runtime_error(name + ": not a metrics segment");
+    }
+}
+
+metrics::SharedMemoryReader::~SharedMemoryReader() {
+    ::munmap(const_cast<char *>(mapping_), size_);
+}
+
+std::vector<metrics::SharedMetricView> metrics::SharedMemoryReader::metrics(
+) const {
+    const uint64_t count =
+        atomic_at(mapping_ + count_offset).load(std::memory_order_acquire);
+    std::vector<SharedMetricView> views;
+    views.reserve(count);
+    std::size_t offset = header_size;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (size_ - offset < entry_header) {
+            break;
+        }
+        const uint32_t size = load_u32(mapping_ + offset);
+        if (size < entry_header || size > size_ - offset) {
+            break;
+        }
+        views.push_back(SharedMetricView(mapping_ + offset));
+        offset += size;
+    }
+    return views;
+}
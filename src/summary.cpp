@@ -0,0 +1,327 @@
+#include "summary.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "openmetrics.hpp"
+
+metrics::QuantileSketch::QuantileSketch(
+    double relative_accuracy,
+    std::size_t max_bins
+)
+    : relative_accuracy_(std::clamp(relative_accuracy, 1e-6, 0.5)),
+      gamma_((1.0 + relative_accuracy_) / (1.0 - relative_accuracy_)),
+      inv_log_gamma_(1.0 / std::log(gamma_)),
+      max_bins_(std::max<std::size_t>(max_bins, 1)) {
+}
+
+void metrics::QuantileSketch::Store::add(
+    int index,
+    uint64_t count,
+    std::size_t max_bins
+) {
+    if (bins.empty()) {
+        offset = index;
+        bins.assign(1, count);
+        return;
+    }
+
+    const int low = offset;
+    const int high = offset + static_cast<int>(bins.size()) - 1;
+    if (index >= low && index <= high) {
+        bins[index - low] += count;
+        return;
+    }
+
+    const int new_high = std::max(high, index);
+    const int new_low = std::max(
+        std::min(low, index), new_high - static_cast<int>(max_bins) + 1
+    );
+    std::vector<uint64_t> fresh(new_high - new_low + 1, 0);
+    for (std::size_t i = 0; i < bins.size(); ++i) {
+        const int at = std::max(low + static_cast<int>(i), new_low);
+        fresh[at - new_low] += bins[i];
+    }
+    fresh[std::max(index, new_low) - new_low] += count;
+    bins.swap(fresh);
+    offset = new_low;
+}
+
+int metrics::QuantileSketch::index_of(double magnitude) const noexcept {
+    return static_cast<int>(std::ceil(std::log(magnitude) * inv_log_gamma_));
+}
+
+double metrics::QuantileSketch::value_of(int index) const noexcept {
+    return 2.0 * std::pow(gamma_, index) / (gamma_ + 1.0);
+}
+
+void metrics::QuantileSketch::add(double value, uint64_t count) {
+    if (std::isnan(value) || count == 0) {
+        return;
+    }
+    const double magnitude = std::abs(value);
+    if (magnitude < std::numeric_limits<double>::min()) {
+        zero_count_ += count;
+    } else if (value > 0.0) {
+        positive_.add(index_of(magnitude), count, max_bins_);
+    } else {
+        negative_.add(index_of(magnitude), count, max_bins_);
+    }
+    count_ += count;
+    sum_ += value * static_cast<double>(count);
+}
+
+void metrics::QuantileSketch::merge(const QuantileSketch &other) {
+    if (other.count_ == 0) {
+        return;
+    }
+    const bool same_bins = other.gamma_ == gamma_;
+    auto merge_store = [&](Store &into, const Store &from) {
+        for (std::size_t i = 0; i < from.bins.size(); ++i) {
+            if (from.bins[i] == 0) {
+                continue;
+            }
+            const int index = from.offset + static_cast<int>(i);
+            into.add(
+                same_bins ? index : index_of(other.value_of(index)),
+                from.bins[i], max_bins_
+            );
+        }
+    };
+    merge_store(positive_, other.positive_);
+    merge_store(negative_, other.negative_);
+    zero_count_ += other.zero_count_;
+    count_ += other.count_;
+    sum_ += other.sum_;
+}
+
+void metrics::QuantileSketch::clear() noexcept {
+    positive_.bins.clear();
+    negative_.bins.clear();
+    zero_count_ = 0;
+    count_ = 0;
+    sum_ = 0.0;
+}
+
+double metrics::QuantileSketch::quantile(double q) const noexcept {
+    if (count_ == 0 || std::isnan(q)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    const double rank =
+        std::clamp(q, 0.0, 1.0) * static_cast<double>(count_ - 1);
+
+    uint64_t seen = 0;
+    for (std::size_t i = negative_.bins.size(); i-- > 0;) {
+        seen += negative_.bins[i];
+        if (static_cast<double>(seen) > rank) {
+            return -value_of(negative_.offset + static_cast<int>(i));
+        }
+    }
+    seen += zero_count_;
+    if (static_cast<double>(seen) > rank) {
+        return 0.0;
+    }
+    for (std::size_t i = 0; i < positive_.bins.size(); ++i) {
+        seen += positive_.bins[i];
+        if (static_cast<double>(seen) > rank) {
+            return value_of(positive_.offset + static_cast<int>(i));
+        }
+    }
+    const int last = positive_.offset + static_cast<int>(positive_.bins.size());
+    return positive_.bins.empty() ? 0.0 : value_of(last - 1);
+}
+
+uint64_t metrics::QuantileSketch::count() const noexcept {
+    return count_;
+}
+
+double metrics::QuantileSketch::sum() const noexcept {
+    return sum_;
+}
+
+double metrics::QuantileSketch::relative_accuracy() const noexcept {
+    return relative_accuracy_;
+}
+
+void metrics::Summary::init() {
+    shards_ = std::make_unique<Shard[]>(shard_count);
+    for (std::size_t i = 0; i < shard_count; ++i) {
+        shards_[i].sketch =
+            QuantileSketch(options_.relative_accuracy, options_.max_bins);
+    }
+    const std::size_t windows =
+        options_.max_age.count() > 0
+            ? std::max<std::size_t>(options_.age_buckets, 1)
+            : 1;
+    const QuantileSketch empty(options_.relative_accuracy, options_.max_bins);
+    windows_.assign(windows, Window{empty, -1});
+}
+
+int64_t metrics::Summary::current_epoch() const noexcept {
+    if (options_.max_age.count() <= 0) {
+        return 0;
+    }
+    using namespace std::chrono;
+    const auto slice = std::max<int64_t>(
+        duration_cast<nanoseconds>(options_.max_age).count() /
+            static_cast<int64_t>(windows_.size()),
+        1
+    );
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch())
+               .count() /
+           slice;
+}
+
+void metrics::Summary::drain(Shard &shard) const {
+    if (shard.sketch.count() == 0) {
+        return;
+    }
+    {
+        std::lock_guard lock(windows_mutex_);
+        auto &window = windows_[shard.epoch % windows_.size()];
+        if (window.epoch < shard.epoch) {
+            window.sketch.clear();
+            window.epoch = shard.epoch;
+        }
+        if (window.epoch == shard.epoch) {
+            window.sketch.merge(shard.sketch);
+        }
+    }
+    shard.sketch.clear();
+}
+
+void metrics::Summary::observe(double value) {
+    const int64_t epoch = current_epoch();
+    auto &shard = shards_[this_thread_index() & (shard_count - 1)];
+    std::lock_guard lock(shard.mutex);
+    if (shard.epoch != epoch) {
+        drain(shard);
+        shard.epoch = epoch;
+    }
+    shard.sketch.add(value);
+    changed_.mark();
+}
+
+metrics::QuantileSketch metrics::Summary::get() const {
+    return fold(false);
+}
+
+metrics::QuantileSketch metrics::Summary::fold(bool clear) const {
+    for (std::size_t i = 0; i < shard_count; ++i) {
+        std::lock_guard lock(shards_[i].mutex);
+        drain(shards_[i]);
+    }
+
+    const int64_t epoch = current_epoch();
+    const auto windows = static_cast<int64_t>(windows_.size());
+    QuantileSketch result(options_.relative_accuracy, options_.max_bins);
+    std::lock_guard lock(windows_mutex_);
+    for (auto &window : windows_) {
+        if (window.epoch >= 0 && window.epoch > epoch - windows) {
+            result.merge(window.sketch);
+        }
+        if (clear) {
+            window.sketch.clear();
+            window.epoch = -1;
+        }
+    }
+    return result;
+}
+
+const std::vector<double> &metrics::Summary::quantiles() const noexcept {
+    return quantiles_;
+}
+
+std::string_view metrics::Summary::name() const noexcept {
+    return name_;
+}
+
+void metrics::Summary::append_to(std::string &out) const {
+    append_sketch(out, get());
+}
+
+void metrics::Summary::append_sketch(
+    std::string &out,
+    const QuantileSketch &sketch
+) const {
+    out += '{';
+    for (double q : quantiles_) {
+        out += "\"";
+        out += name_;
+        out += "{quantile=";
+        append_number(out, q);
+        out += "}\" ";
+        append_number(out, sketch.quantile(q));
+        out += " ";
+    }
+
+    out += " \"";
+    out += name_;
+    out += "_sum\" ";
+    append_number(out, sketch.sum());
+    out += " ";
+
+    out += " \"";
+    out += name_;
+    out += "_count\" ";
+    append_number(out, sketch.count());
+    out += "}";
+}
+
+std::string_view metrics::Summary::openmetrics_type() const noexcept {
+    return "summary";
+}
+
+void metrics::Summary::append_openmetrics_samples(std::string &out) const {
+    const QuantileSketch sketch = get();
+    const auto name = split_metric_name(name_);
+    for (double q : quantiles_) {
+        std::string quantile = "quantile=\"";
+        append_openmetrics_value(quantile, q);
+        quantile += '"';
+        append_sample_name(out, name.family, {}, name.labels, quantile);
+        append_openmetrics_value(out, sketch.quantile(q));
+        out += '\n';
+    }
+    append_value_sample(out, name, "_sum", sketch.sum());
+    append_value_sample(out, name, "_count", sketch.count());
+}
+
+void metrics::Summary::reset() noexcept {
+    uint64_t cleared = 0;
+    for (std::size_t i = 0; i < shard_count; ++i) {
+        std::lock_guard lock(shards_[i].mutex);
+        cleared += shards_[i].sketch.count();
+        shards_[i].sketch.clear();
+    }
+    std::lock_guard lock(windows_mutex_);
+    for (auto &window : windows_) {
+        cleared += window.sketch.count();
+        window.sketch.clear();
+        window.epoch = -1;
+    }
+    if (cleared > 0) {
+        changed_.mark();
+    }
+}
+
+void metrics::Summary::collect_and_reset(std::string &out) {
+    // Windowed summaries age out by epoch; clearing them here would narrow
+    // the window to the time since the last flush.
+    const QuantileSketch sketch = fold(options_.max_age.count() <= 0);
+    if (sketch.count() > 0) {
+        changed_.mark();
+    }
+    append_sketch(out, sketch);
+}
+
+bool metrics::Summary::consume_changed() noexcept {
+    // Windowed quantiles also change when old observations expire.
+    const bool changed = changed_.consume();
+    return changed || options_.max_age.count() > 0;
+}
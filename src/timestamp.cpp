@@ -0,0 +1,82 @@
+#include "timestamp.hpp"
+#include <chrono>
+#include <ctime>
+#include <string>
+#include "format.hpp"
+
+namespace {
+
+void put_digits(char *out, int value, int width) {
+    for (int i = width - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+}
+
+}  // namespace
+
+metrics::TimestampFormatter::TimestampFormatter(TimestampFormat format
+) noexcept
+    : format_(format), cached_second_(-1), prefix_{} {
+}
+
+metrics::TimestampFormat metrics::TimestampFormatter::format() const noexcept {
+    return format_;
+}
+
+void metrics::TimestampFormatter::set_format(TimestampFormat format) noexcept {
+    format_ = format;
+}
+
+void metrics::TimestampFormatter::append_to(std::string &out) {
+    append_to(out, std::chrono::system_clock::now());
+}
+
+void metrics::TimestampFormatter::append_to(
+    std::string &out,
+    std::chrono::system_clock::time_point now
+) {
+    using namespace std::chrono;
+    if (format_ == TimestampFormat::EpochNanos) {
+        append_number(
+            out, duration_cast<nanoseconds>(now.time_since_epoch()).count()
+        );
+        return;
+    }
+
+    const auto since_epoch =
+        duration_cast<milliseconds>(now.time_since_epoch());
+    auto second = duration_cast<seconds>(since_epoch);
+    auto millis = since_epoch - second;
+    if (millis.count() < 0) {
+        second -= seconds{1};
+        millis += seconds{1};
+    }
+
+    const auto now_time_t = static_cast<std::time_t>(second.count());
+    if (now_time_t != cached_second_) {
+        std::tm now_tm;
+#ifdef _WIN32
+        localtime_s(&now_tm, &now_time_t);
+#else
+        localtime_r(&now_time_t, &now_tm);
+#endif
+        put_digits(prefix_, now_tm.tm_year + 1900, 4);
+        prefix_[4] = '-';
+        put_digits(prefix_ + 5, now_tm.tm_mon + 1, 2);
+        prefix_[7] = '-';
+        put_digits(prefix_ + 8, now_tm.tm_mday, 2);
+        prefix_[10] = ' ';
+        put_digits(prefix_ + 11, now_tm.tm_hour, 2);
+        prefix_[13] = ':';
+        put_digits(prefix_ + 14, now_tm.tm_min, 2);
+        prefix_[16] = ':';
+        put_digits(prefix_ + 17, now_tm.tm_sec, 2);
+        cached_second_ = now_time_t;
+    }
+
+    char suffix[4] = {'.'};
+    put_digits(suffix + 1, static_cast<int>(millis.count()), 3);
+    out.append(prefix_, prefix_length);
+    out.append(suffix, sizeof(suffix));
+}
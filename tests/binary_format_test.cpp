@@ -0,0 +1,164 @@
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "binary_format.hpp"
+#include "counter.hpp"
+#include "family.hpp"
+#include "format.hpp"
+#include "gauge.hpp"
+#include "histogram.hpp"
+#include "info.hpp"
+#include "meter.hpp"
+#include "metric.hpp"
+#include "native_histogram.hpp"
+#include "static_set.hpp"
+#include "summary.hpp"
+#include "timestamp.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if (!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// Frame types of an encoded chunk, see BinaryEncoder.
+std::string frame_types(std::string_view frames) {
+    std::string types;
+    while (!frames.empty()) {
+        types += frames.front();
+        frames.remove_prefix(1);
+        uint64_t length = 0;
+        for (int shift = 0;; shift += 7) {
+            const auto byte = static_cast<uint8_t>(frames.front());
+            frames.remove_prefix(1);
+            length |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+        }
+        frames.remove_prefix(length);
+    }
+    return types;
+}
+
+// Encodes one flush of the metrics, laid out like a collector line, and
+// checks that decoding it gives the text line. Returns the frame types.
+std::string round_trip(
+    const std::vector<std::shared_ptr<Metric>> &metrics,
+    std::chrono::system_clock::time_point now,
+    BinaryEncoder &encoder,
+    BinaryDecoder &decoder
+) {
+    std::string body;
+    ValueLayout layout;
+    {
+        RecordValues record(layout, body);
+        for (const auto &metric : metrics) {
+            body += " \"";
+            body += metric->name();
+            body += "\" ";
+            metric->collect_and_reset(body);
+        }
+    }
+
+    std::string expected;
+    TimestampFormatter timestamp(TimestampFormat::EpochNanos);
+    timestamp.append_to(expected, now);
+    expected += body;
+    expected += '\n';
+
+    std::string frames;
+    encoder.encode(frames, now, body, layout.values);
+    std::string decoded;
+    check(decoder.decode(frames, decoded), "decodes");
+    check(decoder.idle(), "decodes whole frames");
+    if (decoded != expected) {
+        std::fprintf(
+            stderr, "expected: %sdecoded:  %s", expected.c_str(),
+            decoded.c_str()
+        );
+        check(false, "round trip reproduces the text line");
+    }
+    return frame_types(frames);
+}
+
+}  // namespace
+
+int main() {
+    auto counter = std::make_shared<Counter<>>("requests_total");
+    auto signed_gauge = std::make_shared<Gauge<int64_t>>("temperature");
+    auto double_gauge = std::make_shared<Gauge<double>>("load");
+    auto float_gauge = std::make_shared<Gauge<float>>("ratio");
+    auto histogram = std::make_shared<Histogram>(
+        "latency", std::vector<double>{0.5, 1, 2.5}
+    );
+    auto native = std::make_shared<NativeHistogram>("sizes");
+    auto summary = std::make_shared<Summary>("durations");
+    auto meter = std::make_shared<Meter>("events");
+    auto family = std::make_shared<Family<Gauge<double>>>(
+        "queue", std::vector<std::string>{"name"}
+    );
+    using Set = StaticMetricSet<
+        "http", StaticCounter<"hits_total">,
+        StaticGauge<"share", double>>;
+    auto set = std::make_shared<Set>();
+    auto info = std::make_shared<Info>(
+        "build", std::vector<std::pair<std::string, std::string>>{
+                     {"version", "1.2.3"}}
+    );
+    const std::vector<std::shared_ptr<Metric>> all = {
+        counter, signed_gauge, double_gauge, float_gauge, histogram,
+        summary, meter,   family,       set,          info
+    };
+
+    BinaryEncoder encoder;
+    BinaryDecoder decoder(TimestampFormat::EpochNanos);
+    auto now = std::chrono::system_clock::now();
+
+    // Doubles that print as integers on some flushes and as fractions on
+    // others must keep the slot type, and with it the template.
+    const double loads[] = {13, 12.5, -7, 0.1, 1e300, 42};
+    for (int flush = 0; flush < 6; ++flush) {
+        counter->inc_by(static_cast<uint64_t>(flush * 1000));
+        signed_gauge->set(-flush);
+        double_gauge->set(loads[flush]);
+        float_gauge->set(static_cast<float>(flush) / 3);
+        histogram->observe(flush % 2 == 0 ? 2.0 : 0.25);
+        summary->observe(flush + 0.5);
+        meter->mark(static_cast<uint64_t>(flush));
+        family->with_labels({"a"})->set(flush % 2 == 0 ? 1.0 : 1.5);
+        set->inc<"hits_total">();
+        set->set<"share">(flush % 2 == 0 ? 3.0 : 0.75);
+
+        const std::string types = round_trip(all, now, encoder, decoder);
+        check(
+            types == (flush == 0 ? "HTR" : "R"),
+            "one template for values that print differently"
+        );
+        now += std::chrono::seconds(1);
+    }
+
+    // Native histograms list populated buckets only, so new buckets may
+    // need a new template, but the line still round-trips.
+    native->observe(3);
+    round_trip({native, double_gauge}, now, encoder, decoder);
+    native->observe(3000);
+    round_trip({native, double_gauge}, now, encoder, decoder);
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
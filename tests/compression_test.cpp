@@ -0,0 +1,161 @@
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "compression.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if (!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+uint32_t read_u32(std::string_view in, std::size_t at) {
+    uint32_t value = 0;
+    for (int b = 3; b >= 0; --b) {
+        value = (value << 8) | static_cast<uint8_t>(in[at + b]);
+    }
+    return value;
+}
+
+std::size_t read_length(std::string_view in, std::size_t &at) {
+    std::size_t length = 0;
+    uint8_t byte;
+    do {
+        byte = static_cast<uint8_t>(in.at(at++));
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+// Decodes concatenated LZ4 frames as written by the built-in compressor:
+// no checksums or content size, blocks may refer to earlier ones.
+std::string lz4_decode(std::string_view in) {
+    std::string out;
+    std::size_t at = 0;
+    while (at < in.size()) {
+        if (read_u32(in, at) != 0x184D2204) {
+            throw std::runtime_error("bad magic");
+        }
+        at += 7;
+        const std::size_t frame = out.size();
+        while (const uint32_t header = read_u32(in, at)) {
+            at += 4;
+            const std::size_t size = header & 0x7FFFFFFF;
+            if (header & 0x80000000) {
+                out.append(in.substr(at, size));
+                at += size;
+                continue;
+            }
+            const std::size_t end = at + size;
+            while (at < end) {
+                const auto token = static_cast<uint8_t>(in[at++]);
+                std::size_t literals = token >> 4;
+                if (literals == 15) {
+                    literals += read_length(in, at);
+                }
+                out.append(in.substr(at, literals));
+                at += literals;
+                if (at == end) {
+                    break;
+                }
+                const std::size_t offset = static_cast<uint8_t>(in[at]) |
+                                           static_cast<uint8_t>(in[at + 1])
+                                               << 8;
+                at += 2;
+                std::size_t length = token & 15;
+                if (length == 15) {
+                    length += read_length(in, at);
+                }
+                length += 4;
+                if (offset == 0 || offset > out.size() - frame) {
+                    throw std::runtime_error("bad offset");
+                }
+                for (std::size_t i = 0; i < length; ++i) {
+                    out += out[out.size() - offset];
+                }
+            }
+        }
+        at += 4;
+    }
+    return out;
+}
+
+// A counter flushed like the collector does, one line per batch.
+std::string counter_line(int flush) {
+    char line[64];
+    std::snprintf(
+        line, sizeof(line), "2026-10-17T05:%02d:%02d.%03dZ \"hits\" %d\n",
+        flush / 3600 % 60, flush / 60 % 60, flush % 1000, flush
+    );
+    return line;
+}
+
+}  // namespace
+
+int main() {
+    // Repetitive lines, each flushed as the writer flushes a batch, must
+    // compress: matches have to reach back into earlier blocks.
+    for (const auto compression : {Compression::Lz4, Compression::Gzip}) {
+        std::unique_ptr<StreamCompressor> compressor;
+        try {
+            compressor = make_compressor(compression);
+        } catch (const std::invalid_argument &) {
+            continue;  // built without zlib
+        }
+        std::string plain;
+        std::string compressed;
+        for (int flush = 0; flush < 2000; ++flush) {
+            const std::string line = counter_line(flush);
+            plain += line;
+            compressor->compress(line, compressed);
+            compressor->flush(compressed);
+        }
+        compressor->finish(compressed);
+        check(
+            compressed.size() < plain.size() / 2,
+            "repetitive lines compress to under half"
+        );
+        if (compression == Compression::Lz4) {
+            check(lz4_decode(compressed) == plain, "lz4 round trip");
+        }
+    }
+
+    // Batches over a block, incompressible data stored raw, and a second
+    // frame after finish(), which must not refer to the first.
+    auto lz4 = make_compressor(Compression::Lz4);
+    std::string plain;
+    std::string compressed;
+    uint32_t state = 1;
+    for (int batch = 0; batch < 6; ++batch) {
+        std::string data;
+        for (int i = 0; i < 50000; ++i) {
+            data += counter_line(batch * 50000 + i % 300).substr(0, 10);
+            state = state * 1664525 + 1013904223;
+            data += static_cast<char>(state >> 24);
+        }
+        plain += data;
+        lz4->compress(data, compressed);
+        lz4->flush(compressed);
+        if (batch == 2) {
+            lz4->finish(compressed);
+        }
+    }
+    lz4->finish(compressed);
+    check(lz4_decode(compressed) == plain, "lz4 round trip over blocks");
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
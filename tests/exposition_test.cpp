@@ -0,0 +1,133 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "collector.hpp"
+#include "counter.hpp"
+#include "exposition_server.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if (!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+template <typename F>
+bool throws_logic_error(F &&f) {
+    try {
+        f();
+    } catch (const std::logic_error &) {
+        return true;
+    }
+    return false;
+}
+
+// One GET /metrics on a fresh connection; returns the whole response.
+std::string scrape(uint16_t port) {
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    std::string response;
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)
+        ) == 0) {
+        const std::string request =
+            "GET /metrics HTTP/1.1\r\nHost: localhost\r\n"
+            "Connection: close\r\n\r\n";
+        if (::write(fd, request.data(), request.size()) ==
+            static_cast<ssize_t>(request.size())) {
+            char buffer[4096];
+            ssize_t length;
+            while ((length = ::read(fd, buffer, sizeof(buffer))) > 0) {
+                response.append(buffer, static_cast<std::size_t>(length));
+            }
+        }
+    }
+    ::close(fd);
+    return response;
+}
+
+// Value of the requests_total sample in a scrape, or -1.
+long scraped_requests(uint16_t port) {
+    const std::string response = scrape(port);
+    const std::string key = "\nrequests_total ";
+    const auto at = response.find(key);
+    if (at == std::string::npos) {
+        return -1;
+    }
+    return std::stol(response.substr(at + key.size()));
+}
+
+}  // namespace
+
+int main() {
+    MetricsCollector collector;
+    auto requests = collector.get_or_register<Counter<>>("requests_total");
+    ExpositionOptions options;
+    options.port = 0;
+    options.interval = std::chrono::milliseconds(10);
+
+    // A collector that writes files cannot be exposed as well.
+    const std::size_t sink = collector.add_sink("exposition_test.log");
+    check(
+        throws_logic_error([&] {
+            ExpositionServer server(collector, options);
+        }),
+        "server rejects a collector with sinks"
+    );
+    collector.remove_sink(sink);
+
+    {
+        ExpositionServer server(collector, options);
+        requests->inc_by(5);
+        check(
+            throws_logic_error([&] {
+                collector.flush("exposition_test.log");
+            }),
+            "flush rejected while exposed"
+        );
+        check(
+            throws_logic_error([&] {
+                collector.add_sink("exposition_test.log");
+            }),
+            "add_sink rejected while exposed"
+        );
+
+        // Scrapes never see the counter go down.
+        long previous = 0;
+        for (int i = 0; i < 20; ++i) {
+            requests->inc();
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            const long value = scraped_requests(server.port());
+            check(value >= previous, "scraped counter never decreases");
+            previous = value;
+        }
+        check(previous >= 5, "scrape sees the counter");
+    }
+
+    // Once the server is gone the collector can be flushed again.
+    check(
+        !throws_logic_error([&] { collector.flush("exposition_test.log"); }),
+        "flush allowed after the server stops"
+    );
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
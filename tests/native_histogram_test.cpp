@@ -0,0 +1,64 @@
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include "native_histogram.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if (!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+}  // namespace
+
+int main() {
+    // Values beyond the bucket range must not be counted in a finite bucket
+    // whose bound is below them.
+    NativeHistogram sizes("sizes", 0);
+    sizes.observe(1.0);
+    sizes.observe(1e39);
+    sizes.observe(std::numeric_limits<double>::infinity());
+    sizes.observe(-1e39);
+
+    const auto snapshot = sizes.get();
+    check(snapshot.count == 4, "count includes overflow");
+    check(snapshot.overflow == 2, "overflow count");
+    check(snapshot.cumulative.back() == 2, "finite buckets exclude overflow");
+    for (const auto &bucket : snapshot.buckets) {
+        check(bucket.upper <= 1.0, "no finite bucket holds an overflow");
+    }
+    check(std::isinf(snapshot.buckets.front().lower), "open lowest bucket");
+    check(snapshot.buckets.front().upper < -1e38, "lowest bucket bound");
+    check(std::isinf(snapshot.quantile(1.0)), "top quantile overflows");
+    check(snapshot.quantile(0.0) < -1e38, "bottom quantile");
+
+    std::string text;
+    sizes.append_openmetrics_samples(text);
+    check(
+        text.find("sizes_bucket{le=\"1\"} 2\n") != std::string::npos,
+        "last finite bucket"
+    );
+    check(
+        text.find("sizes_bucket{le=\"+Inf\"} 4\n") != std::string::npos,
+        "+Inf bucket"
+    );
+    check(text.find("sizes_count 4\n") != std::string::npos, "_count");
+
+    std::string line;
+    sizes.collect_and_reset(line);
+    check(sizes.get().count == 0, "collection clears overflow");
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include "summary.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if (!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// The _count of a collector line written by collect_and_reset.
+std::string flushed_count(Summary &summary) {
+    std::string out;
+    summary.collect_and_reset(out);
+    const std::string key = std::string(summary.name()) + "_count\" ";
+    const auto at = out.find(key);
+    if (at == std::string::npos) {
+        return {};
+    }
+    return out.substr(at + key.size(), out.find('}', at) - at - key.size());
+}
+
+}  // namespace
+
+int main() {
+    // Two flushes well inside max_age: the second still reports the
+    // samples of the first interval.
+    SummaryOptions windowed;
+    windowed.max_age = std::chrono::minutes(10);
+    Summary recent("recent", {0.5}, windowed);
+    for (int i = 0; i < 100; ++i) {
+        recent.observe(i);
+    }
+    check(flushed_count(recent) == "100", "first windowed flush");
+    for (int i = 0; i < 50; ++i) {
+        recent.observe(1000 + i);
+    }
+    check(flushed_count(recent) == "150", "windowed flush keeps the window");
+    check(recent.get().quantile(0.0) < 1.0, "window keeps old samples");
+
+    // Without max_age a flush starts over.
+    Summary total("total", {0.5});
+    for (int i = 0; i < 100; ++i) {
+        total.observe(i);
+    }
+    check(flushed_count(total) == "100", "first plain flush");
+    for (int i = 0; i < 50; ++i) {
+        total.observe(i);
+    }
+    check(flushed_count(total) == "50", "plain flush clears");
+
+    // A window that has passed is dropped on the next flush.
+    SummaryOptions short_window;
+    short_window.max_age = std::chrono::milliseconds(50);
+    short_window.age_buckets = 2;
+    Summary brief("brief", {0.5}, short_window);
+    brief.observe(1);
+    check(flushed_count(brief) == "1", "short window flush");
+    std::this_thread::sleep_for(std::chrono::milliseconds(120));
+    check(flushed_count(brief) == "0", "expired window");
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
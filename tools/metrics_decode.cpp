@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "binary_format.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int usage(const char *program) {
+    std::fprintf(
+        stderr,
+        "usage: %s [--epoch-nanos] <input> [output]\n"
+        "Converts a binary metrics file back to the text format.\n",
+        program
+    );
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    TimestampFormat format = TimestampFormat::LocalTime;
+    int arg = 1;
+    if (arg < argc && std::strcmp(argv[arg], "--epoch-nanos") == 0) {
+        format = TimestampFormat::EpochNanos;
+        ++arg;
+    }
+    if (arg >= argc || argc - arg > 2) {
+        return usage(argv[0]);
+    }
+
+    FILE *input = std::fopen(argv[arg], "rb");
+    if (!input) {
+        std::perror(argv[arg]);
+        return 1;
+    }
+    FILE *output = stdout;
+    if (argc - arg == 2) {
+        output = std::fopen(argv[arg + 1], "w");
+        if (!output) {
+            std::perror(argv[arg + 1]);
+            std::fclose(input);
+            return 1;
+        }
+    }
+
+    BinaryDecoder decoder(format);
+    std::string text;
+    char chunk[1 << 16];
+    bool ok = true;
+    std::size_t read;
+    while (ok && (read = std::fread(chunk, 1, sizeof(chunk), input)) > 0) {
+        text.clear();
+        ok = decoder.decode(std::string_view(chunk, read), text);
+        std::fwrite(text.data(), 1, text.size(), output);
+    }
+
+    int status = 0;
+    if (!ok) {
+        std::fprintf(stderr, "%s: malformed input\n", argv[arg]);
+        status = 1;
+    } else if (!decoder.idle()) {
+        std::fprintf(stderr, "%s: truncated last record\n", argv[arg]);
+        status = 1;
+    }
+    std::fclose(input);
+    if (output != stdout) {
+        std::fclose(output);
+    }
+    return status;
+}
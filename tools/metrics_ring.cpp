@@ -0,0 +1,49 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <string>
+#include "ring_file.hpp"
+
+using namespace metrics;
+
+namespace {
+
+int usage(const char *program) {
+    std::fprintf(
+        stderr,
+        "usage: %s [-n count] <ring file>\n"
+        "Prints the lines kept in a ring sink, oldest first.\n",
+        program
+    );
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    std::size_t count = std::numeric_limits<std::size_t>::max();
+    int arg = 1;
+    if (arg + 1 < argc && std::strcmp(argv[arg], "-n") == 0) {
+        char *end = nullptr;
+        count = std::strtoull(argv[arg + 1], &end, 10);
+        if (*end != '\0') {
+            return usage(argv[0]);
+        }
+        arg += 2;
+    }
+    if (argc - arg != 1) {
+        return usage(argv[0]);
+    }
+
+    try {
+        for (const auto &record : read_ring_file(argv[arg], count)) {
+            std::fwrite(record.data.data(), 1, record.data.size(), stdout);
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}